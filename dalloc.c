@@ -1,14 +1,27 @@
 #define _GNU_SOURCE
 
 #include <unistd.h>
+#include <stdlib.h>	// getenv, strtol
 #include <string.h> // memset etc..
+#include <stdio.h>	// dalloc_stats_print
+#include <stdarg.h>	// va_list, for the profile writer
 #include <stdint.h>	// for SIZE_MAX (or <limits.h>)
 #include <pthread.h> 
 #include <errno.h>
+#include <time.h>		// clock_gettime
+#include <signal.h>		// sigaction, for the guarded sampling report
+#include <semaphore.h>		// sem_post, to wake the profile dumper from a signal handler
+#include <fcntl.h>			// open, for the profile dump
+#include <execinfo.h>		// backtrace, for the heap profiler
+#include <sys/mman.h>	// mmap, munmap, madvise, mremap
 
 #include "dalloc.h"
 
-static pthread_mutex_t global_malloc_lock;
+static void dalloc_startup(void);
+
+// Thread-local state lives in the static TLS block: with LD_PRELOAD, the default
+// (dynamic) model could call malloc to allocate it, i.e. call us recursively.
+#define DALLOC_TLS __thread __attribute__((tls_model("initial-exec")))
 
 // ***********************************************************************
 // Cross-Platform Constructor Macros
@@ -22,10 +35,7 @@ static pthread_mutex_t global_malloc_lock;
     __attribute__((constructor))
     void dalloc_init_lock() 
     {
-        pthread_mutexattr_t attr;
-        pthread_mutexattr_init(&attr);
-        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-        pthread_mutex_init(&global_malloc_lock, &attr);
+        dalloc_startup();
         // printf("dalloc: Lock (Linux/Mac) started.\n");
     }
 
@@ -45,80 +55,422 @@ static pthread_mutex_t global_malloc_lock;
     
     void dalloc_init_lock() 
     {
-        pthread_mutexattr_t attr;
-        pthread_mutexattr_init(&attr);
-        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-        pthread_mutex_init(&global_malloc_lock, &attr);
+        dalloc_startup();
         // printf("dalloc: Lock (Windows) started.\n");
     }
 
 #endif
 
+/*
+ * Block header: two words, 16 bytes, so the payload after it stays 16-byte aligned.
+ *
+ * Sizes are multiples of 16, their 4 low bits are always 0: the status bits take
+ * their place (three bits more than that, sizes stay far below 2^57). The neighbours
+ * are not stored as pointers, they are found by size:
+ *   next block:     header + 1 + size                (always there: a fence ends every chunk)
+ *   previous block: header - 1 - prev_size           (none if prev_size is 0: first of its chunk)
+ */
 typedef union header {
 	struct {
-		size_t size; 		// Allocation Size 
-		unsigned is_free;
-		union header *pNext;
+		size_t is_free : 1;
+		size_t is_mmapped : 1;	// Served by its own mmap(), not part of any arena
+		size_t is_purged : 1;	// Free block whose inner pages were given back with madvise()
+		size_t is_fence : 1;	// Size 0 block that closes a chunk, never free, never merged
+		size_t is_fresh : 1;	// Never handed out since the OS gave it: zero, except the free links
+		size_t is_huge : 1;		// Mapped block placed on huge pages (see mmap_alloc)
+		size_t is_sampled : 1;	// Recorded by the heap profiler until it is freed
+		size_t size : 57;		// Allocation Size (payload bytes)
+
+		size_t prev_size : 56;	// Payload bytes of the block right before it in memory
+		size_t arena : 8;		// Index of the arena that owns the block
 	} data;
 	unsigned __int128 alignment_enforcer;
 } header_t;
 
 #define ALIGNMENT 16
 #define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
+#define ALIGN_UP(value, alignment) (((value) + ((alignment) - 1)) & ~((uintptr_t)(alignment) - 1))
+
+static size_t page_size = 4096;	// Updated from sysconf() by dalloc_init()
+
+#define PAGE_ALIGN(size) (((size) + (page_size - 1)) & ~(page_size - 1))
+
+// ***********************************************************************
+// Segregated Free-Block Index (Two-Level Segregated Fit, TLSF)
+// ***********************************************************************
+
+/*
+ * Free blocks are not found by walking the arena's chunks. Every
+ * free block is also linked into one of the segregated lists below, selected
+ * by its size:
+ *
+ *   First level (fl):  power of two range of the size  -> [2^fl, 2^(fl+1))
+ *   Second level (sl): that range split into SL_COUNT equal slices
+ *
+ * Two bitmaps remember which lists are non-empty, so finding a list that is
+ * guaranteed to fit a request costs two 'count trailing zeros' instructions,
+ * no matter how many blocks the heap has.
+ * Sizes below SMALL_BLOCK_SIZE all go to fl 0 and are sliced by ALIGNMENT.
+ */
+#define SL_COUNT_LOG2		4
+#define SL_COUNT			(1 << SL_COUNT_LOG2)			// 16 lists per power of two
+#define FL_SHIFT			(SL_COUNT_LOG2 + 4)				// 4 = log2(ALIGNMENT)
+#define SMALL_BLOCK_SIZE	((size_t)1 << FL_SHIFT)			// 256 bytes
+#define FL_COUNT			(64 - FL_SHIFT + 1)
 
-header_t *pHead = NULL;
-header_t *pTail = NULL;
+// A free block's payload is unused, so the list links are stored there.
+// The smallest payload is ALIGNMENT (16) bytes which is exactly two pointers.
+typedef struct free_links {
+	header_t *pPrevFree;
+	header_t *pNextFree;
+} free_links_t;
 
-static header_t *get_free_block(size_t size) 
+#define FREE_LINKS(pBlock) ((free_links_t *)((pBlock) + 1))
+
+// Free blocks big enough to hold whole pages also remember when they became free
+// (right after the links), so the decay purger can tell how long they stayed unused.
+#define PURGE_MIN_SIZE		(2 * page_size)
+#define FREE_STAMP(pBlock)	(*(uint64_t *)(FREE_LINKS(pBlock) + 1))
+
+// Bytes of a free block's payload the index may have written to (links and stamp)
+#define FREE_DIRTY_SIZE		(sizeof(free_links_t) + sizeof(uint64_t))
+
+static unsigned decay_ms;	// 0: no time-decayed purging, set by dallopt(DALLOC_OPT_DECAY_MS)
+static pthread_mutex_t purger_lock = PTHREAD_MUTEX_INITIALIZER;
+static int purger_started;	// The background thread of decay_ms is running (see Giving Memory Back to the OS)
+
+// Coarse monotonic clock in milliseconds, cheap enough to read on every large free
+static inline uint64_t now_ms(void)
 {
-    header_t *pCurr = pHead;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
 
-    while (pCurr) {
-        if (pCurr->data.is_free && pCurr->data.size >= size) 
-            return pCurr;
-            
-        pCurr = pCurr->data.pNext;
-    }
-    
-    return NULL;
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Precise monotonic clock in nanoseconds, only read when a thread has to wait for a lock
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Index of the most significant set bit (floor(log2(size)))
+static inline unsigned fls_size(size_t size)
+{
+	return 63 - __builtin_clzll(size);
+}
+
+// Finds the list a block of 'size' bytes belongs to
+static inline void mapping_insert(size_t size, unsigned *fl, unsigned *sl)
+{
+	if (size < SMALL_BLOCK_SIZE) {
+		*fl = 0;
+		*sl = size / ALIGNMENT;
+	}
+	else {
+		unsigned msb = fls_size(size);
+		*sl = (size >> (msb - SL_COUNT_LOG2)) ^ SL_COUNT; // Drop the leading 1 bit
+		*fl = msb - FL_SHIFT + 1;
+	}
+}
+
+// Finds the first list whose every block is large enough for 'size'.
+// The size is rounded up to the next slice so any block in that list fits.
+static inline void mapping_search(size_t size, unsigned *fl, unsigned *sl)
+{
+	if (size >= SMALL_BLOCK_SIZE)
+		size += ((size_t)1 << (fls_size(size) - SL_COUNT_LOG2)) - 1;
+
+	mapping_insert(size, fl, sl);
+}
+
+// ***********************************************************************
+// Arenas
+// ***********************************************************************
+
+/*
+ * The heap is split into independent arenas. Each one has its own block list,
+ * free-block index and lock, so threads working on different arenas never wait
+ * for each other. Threads are spread over the arenas round-robin on their first
+ * call, and a block always goes back to the arena recorded in its header.
+ *
+ * Each arena grows in its own reserved address range (see Segments), in steps of
+ * at least ARENA_GROW_SIZE. Each piece of contiguous memory an arena has is a chunk:
+ *
+ *   | chunk_t | block | block | ... | block | fence |
+ *
+ * The blocks of a chunk follow each other without gaps, and the fence (a used
+ * block of size 0) keeps merges from running past its end. New memory right after
+ * the newest chunk continues it: its fence becomes the header of the new block.
+ * A chunk only ends where a segment does.
+ */
+#define ARENA_MAX			64
+#define ARENA_GROW_SIZE		(1024 * 1024)	// Minimum commit of an arena (committed pages cost nothing until touched)
+
+#define SLAB_MAX_SIZE		512							// Largest request served from slabs
+#define SLAB_CLASSES		(SLAB_MAX_SIZE / ALIGNMENT)	// One size class per 16 bytes
+
+// Start of a chunk, links the chunks of an arena so they can be walked
+typedef struct chunk {
+	struct chunk *pNext;
+} chunk_t;
+
+#define CHUNK_HEADER_SIZE	ALIGN(sizeof(chunk_t))	// The first block starts here, 16-byte aligned
+#define CHUNK_FIRST_BLOCK(pChunk)	((header_t *)((char *)(pChunk) + CHUNK_HEADER_SIZE))
+
+typedef struct arena {
+	pthread_mutex_t lock;
+	chunk_t *pChunks;	// Newest first
+	header_t *pTop;		// Fence of the newest chunk, where the next growth may continue
+
+	// Free-block index
+	uint64_t fl_bitmap;
+	uint32_t sl_bitmap[FL_COUNT];
+	header_t *free_lists[FL_COUNT][SL_COUNT];
+
+	// Where the last next-fit search stopped (see Placement Policies)
+	header_t *pRover;
+	chunk_t *pRoverChunk;
+
+	// Slabs with free slots, one list per small size class
+	struct slab *pSlabs[SLAB_CLASSES];
+
+	// Blocks freed by other threads while the lock was taken (see remote_push)
+	void *pRemoteFrees;
+
+	// Current segment: committed up to pCommit, reserved up to pReserveEnd
+	char *pCommit;
+	char *pReserveEnd;
+	int segment_huge;	// Reserved in huge page mode
+} arena_t;
+
+// The locks are ready before any code runs, even if dalloc is called
+// (e.g. through LD_PRELOAD) before the constructor
+static arena_t arenas[ARENA_MAX] = {
+	[0 ... ARENA_MAX - 1] = { .lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP }
+};
+static unsigned arena_count = 1;	// Set to the number of CPUs by dalloc_init()
+static unsigned arena_next;			// Round-robin counter for thread assignment
+static int initialized;				// Set last by dalloc_init_slow() (release), read with acquire
+static int init_claimed;			// A thread is running dalloc_init_slow()
+static DALLOC_TLS int init_running;	// ... and it is this one
+
+static DALLOC_TLS arena_t *pThreadArena;
+
+/*
+ * Event counters for dalloc_stats(). They only change on the slow paths (system
+ * calls, lock waits), never per allocation, and with relaxed atomics: they are
+ * statistics, nothing is ordered by them.
+ */
+static struct {
+	size_t heap_bytes;			// Arena memory committed in segments
+	size_t mmap_bytes;			// Memory of the large blocks with their own mapping
+	size_t mmap_blocks;
+	uint64_t mprotect_calls;
+	uint64_t mmap_calls;
+	uint64_t mremap_calls;
+	uint64_t munmap_calls;
+	uint64_t madvise_calls;
+	uint64_t lock_waits;
+	uint64_t lock_wait_ns;
+	uint64_t remote_frees;
+	uint64_t guarded_allocs;
+	size_t hugepage_advised_bytes;	// Heap segments and mapped blocks advised for huge pages
+} counters;
+
+#define STAT_ADD(field, n)	__atomic_fetch_add(&counters.field, (n), __ATOMIC_RELAXED)
+#define STAT_SUB(field, n)	__atomic_fetch_sub(&counters.field, (n), __ATOMIC_RELAXED)
+#define STAT_GET(field)		__atomic_load_n(&counters.field, __ATOMIC_RELAXED)
+
+static void remote_drain(arena_t *pArena);
+static int purger_start(void);
+
+// Locks the arena. Only a thread that finds it taken reads the clock, to count the wait.
+// Blocks other threads queued for the arena while it was taken are freed first.
+static inline void arena_lock(arena_t *pArena)
+{
+	if (pthread_mutex_trylock(&pArena->lock) != 0) {
+		uint64_t start = now_ns();
+		pthread_mutex_lock(&pArena->lock);
+
+		STAT_ADD(lock_waits, 1);
+		STAT_ADD(lock_wait_ns, now_ns() - start);
+	}
+
+	if (__atomic_load_n(&pArena->pRemoteFrees, __ATOMIC_RELAXED))
+		remote_drain(pArena);
+}
+
+// Reads the machine's parameters. 'initialized' is published only after them:
+// a thread that sees it set never uses the default page_size.
+static void __attribute__((noinline)) dalloc_init_slow(void)
+{
+	if (__atomic_exchange_n(&init_claimed, 1, __ATOMIC_ACQ_REL)) {
+		// Called again from inside (e.g. sysconf() allocating): the defaults have to do.
+		// Another thread waits, it is a matter of two system calls.
+		if (!init_running)
+			while (!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE))
+				sched_yield();
+		return;
+	}
+
+	init_running = 1;
+
+	// Once: in a forked child this runs again (see fork_child), the parameters and any dallopt() stay
+	static int machine_read;
+	if (!machine_read) {
+		long page = sysconf(_SC_PAGESIZE);
+		if (page > 0)
+			page_size = page;
+
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (cpus < 1)
+			cpus = 1;
+		arena_count = cpus > ARENA_MAX ? ARENA_MAX : cpus;
+		machine_read = 1;
+	}
+
+	// A forked child inherits decay_ms but not the purger thread. Started here, no arena lock is held
+	if (decay_ms && !purger_started)
+		purger_start();
+
+	init_running = 0;
+	__atomic_store_n(&initialized, 1, __ATOMIC_RELEASE);
+}
+
+// Every public function starts with it, before anything that depends on page_size:
+// with LD_PRELOAD, calls may arrive before the constructor
+static inline void dalloc_init(void)
+{
+	if (__builtin_expect(!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE), 0))
+		dalloc_init_slow();
+}
+
+// Arena of the calling thread, picked round-robin on the first call
+static inline arena_t *thread_arena(void)
+{
+	if (!pThreadArena) {
+		pThreadArena = &arenas[__atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED) % arena_count];
+	}
+
+	return pThreadArena;
+}
+
+// Arena that owns the block
+static inline arena_t *block_arena(header_t *pBlock)
+{
+	return &arenas[pBlock->data.arena];
+}
+
+// The block right after it in memory (the fence, at the end of a chunk)
+static inline header_t *next_block(header_t *pBlock)
+{
+	return (header_t *)((char *)(pBlock + 1) + pBlock->data.size);
+}
+
+// The block right before it in memory, NULL for the first block of a chunk
+static inline header_t *prev_block(header_t *pBlock)
+{
+	if (!pBlock->data.prev_size)
+		return NULL;
+
+	return (header_t *)((char *)pBlock - pBlock->data.prev_size) - 1;
+}
+
+// Changes the size of a block and tells the block after it
+static inline void set_size(header_t *pBlock, size_t size)
+{
+	pBlock->data.size = size;
+	next_block(pBlock)->data.prev_size = size;
+}
+
+// Links a free block into the segregated list of its size
+static void index_insert(arena_t *pArena, header_t *pBlock)
+{
+	unsigned fl, sl;
+	mapping_insert(pBlock->data.size, &fl, &sl);
+
+	header_t *pFirst = pArena->free_lists[fl][sl];
+	FREE_LINKS(pBlock)->pPrevFree = NULL;
+	FREE_LINKS(pBlock)->pNextFree = pFirst;
+	if (pFirst)
+		FREE_LINKS(pFirst)->pPrevFree = pBlock;
+
+	pArena->free_lists[fl][sl] = pBlock;
+	pArena->fl_bitmap |= (uint64_t)1 << fl;
+	pArena->sl_bitmap[fl] |= 1U << sl;
+
+	// A new or resized free block: its pages are in use again until the next purge
+	pBlock->data.is_purged = 0;
+
+	// Stamped with decay off too: blocks already free when it is turned on must have a real age
+	if (pBlock->data.size >= PURGE_MIN_SIZE)
+		FREE_STAMP(pBlock) = now_ms();
+}
+
+// Unlinks a free block from its segregated list
+static void index_remove(arena_t *pArena, header_t *pBlock)
+{
+	unsigned fl, sl;
+	mapping_insert(pBlock->data.size, &fl, &sl);
+
+	header_t *pPrev = FREE_LINKS(pBlock)->pPrevFree;
+	header_t *pNext = FREE_LINKS(pBlock)->pNextFree;
+
+	if (pNext)
+		FREE_LINKS(pNext)->pPrevFree = pPrev;
+
+	if (pPrev)
+		FREE_LINKS(pPrev)->pNextFree = pNext;
+	else {
+		// pBlock was the first one of its list
+		pArena->free_lists[fl][sl] = pNext;
+		// Clear the bits if the list became empty
+		if (!pNext) {
+			pArena->sl_bitmap[fl] &= ~(1U << sl);
+			if (!pArena->sl_bitmap[fl])
+				pArena->fl_bitmap &= ~((uint64_t)1 << fl);
+		}
+	}
 }
 
 // Combines the specified block with the block immediately following it
-// The caller must ensure the next block exists and mergable
-static void merge_next(header_t *pBlock)
+// The caller must ensure the next block is mergable (free, not the fence)
+static void merge_next(arena_t *pArena, header_t *pBlock)
 {
-	header_t *pNext = pBlock->data.pNext;
+	header_t *pNext = next_block(pBlock);
+
+	// Both sizes are about to change, so take the free ones out of the index first
+	if (pBlock->data.is_free)
+		index_remove(pArena, pBlock);
+	if (pNext->data.is_free)
+		index_remove(pArena, pNext);
+
+	size_t next_size = pNext->data.size;
+
+	// The next-fit rover must not point into the middle of a block
+	if (pArena->pRover == pNext)
+		pArena->pRover = pBlock;
+
+	// Two untouched blocks stay untouched as one: clear the bytes between them that are not zero
+	if (pBlock->data.is_fresh && pNext->data.is_fresh)
+		memset(pNext, 0, sizeof(header_t) + (next_size < FREE_DIRTY_SIZE ? next_size : FREE_DIRTY_SIZE));
+	else
+		pBlock->data.is_fresh = 0;
 
 	// New size = Current one's size + next one's header + next one's size
-	pBlock->data.size += sizeof(header_t) + pNext->data.size;
-	// Move the pointer to the next one to remove the next one from the list
-	pBlock->data.pNext = pNext->data.pNext;
-	// If tail was pNext, set tail as pBlock
-	if (pTail == pNext)
-		pTail = pBlock;
-}
-
-// Walks the list from the beginning to the end
-// If it finds two adjacent 'freed' blocks, it merges them
-static void coalesce()
-{
-	header_t *pCurr = pHead;
-
-	while (pCurr && pCurr->data.pNext) {
-		// If the current one and the next one are free
-		if (pCurr->data.is_free && pCurr->data.pNext->data.is_free)
-			// Merge them
-			merge_next(pCurr);
-			// Don't advance pCurr here
-			// After merging, the new bigger block might be adjacent to 
-            // yet another free block. Stay to check again.
-		else
-		 	// Walk to the next one if there is no merge
-			pCurr = pCurr->data.pNext;
-	}
+	// (the next one's header simply becomes payload, the block after it learns the new size)
+	set_size(pBlock, pBlock->data.size + sizeof(header_t) + next_size);
+
+	// Put the merged block back into the list matching its new size
+	if (pBlock->data.is_free)
+		index_insert(pArena, pBlock);
 }
 
-static void split_block(header_t *pBlock, size_t size)
+static void split_block(arena_t *pArena, header_t *pBlock, size_t size)
 {
 	// block->data.size: The currently available large size (e.g., 1024)
 	// size: The size requested by the user (e.g., 32)
@@ -131,189 +483,3200 @@ static void split_block(header_t *pBlock, size_t size)
 
 		// Set new block's data
 		// New size = old total size - (Used + Header)
-		pNewBlock->data.size = pBlock->data.size - size - sizeof(header_t);
-		pNewBlock->data.is_free = 1;	// Free
-		pNewBlock->data.pNext = pBlock->data.pNext; 
+		// (the rest of an untouched block is untouched too)
+		*pNewBlock = (header_t){ .data = { .is_free = 1, .is_fresh = pBlock->data.is_fresh,
+										   .prev_size = size, .arena = pBlock->data.arena } };
+		set_size(pNewBlock, pBlock->data.size - size - sizeof(header_t));
 
 		// Set data of splitted block before sending it to the user
+		// (pNewBlock is next to it now, found by its size)
 		pBlock->data.size = size;
 		pBlock->data.is_free = 0;	// Allocating by dalloc
-		pBlock->data.pNext = pNewBlock;	// pNewBlock is next to the block requested (and splitted) by the user.
 
-		// If tail was pBlock before user's memory request and splitting, set tail as pNewBlock
-		if (pTail == pBlock)
-			pTail = pNewBlock;	
+		// The extra portion is reusable from now on
+		index_insert(pArena, pNewBlock);
 	}
 }
 
-void *dalloc(size_t size)
+// ***********************************************************************
+// Placement Policies
+// ***********************************************************************
+
+/*
+ * Which free block a request gets, set by dallopt(DALLOC_OPT_PLACEMENT) or at
+ * build time with -DDALLOC_DEFAULT_PLACEMENT=<policy>:
+ *
+ *   good-fit  (default): the first block of the first list whose blocks all fit.
+ *                        Two bit scans, whatever the heap holds; the block may be
+ *                        up to one slice (1/16) larger than the best one.
+ *   best-fit           : the smallest block that fits. Scans the list of the size,
+ *                        then the next non-empty one (all of its blocks fit).
+ *   first-fit          : the first block that fits in address order, from the
+ *                        start of each chunk (newest chunk first). Walks the heap.
+ *   next-fit           : first-fit starting where the last search stopped (the
+ *                        roving pointer), wrapping around. Walks the heap.
+ *
+ * All of them use the same index: the policy can change at any time, and the
+ * walking ones only cost more when they are selected. The rover always points
+ * at a block header: merge_next() moves it when the block it points at is merged away.
+ */
+#ifndef DALLOC_DEFAULT_PLACEMENT
+	#define DALLOC_DEFAULT_PLACEMENT	DALLOC_PLACEMENT_GOOD_FIT
+#endif
+
+static int placement = DALLOC_DEFAULT_PLACEMENT;	// Changed by dallopt(DALLOC_OPT_PLACEMENT)
+
+static header_t *find_good_fit(arena_t *pArena, size_t size)
 {
-	pthread_mutex_lock(&global_malloc_lock); // Lock
-	
-	size_t total_size;
-	void *pBlock;
-	header_t *pHeader;
+	unsigned fl, sl;
+	mapping_search(size, &fl, &sl);
 
-	if (size == 0) {
-		pthread_mutex_unlock(&global_malloc_lock); 
-		return NULL;
+	// Any non-empty list in the same first level at or above sl?
+	uint32_t sl_map = pArena->sl_bitmap[fl] & (~0U << sl);
+
+	if (!sl_map) {
+		// No, try the next non-empty first level
+		uint64_t fl_map = pArena->fl_bitmap & (~(uint64_t)0 << (fl + 1));
+		if (!fl_map)
+			return NULL;
+
+		fl = __builtin_ctzll(fl_map);
+		sl_map = pArena->sl_bitmap[fl];
 	}
 
-	// Align the user's memory request and add pHeader margin
-	// The pHeader is already aligned thanks to the union, only aligning the size
-	size_t aligned_size = ALIGN(size);
-	total_size = sizeof(header_t) + aligned_size;
+	sl = __builtin_ctz(sl_map);
 
-	// Search in the free list for recycled space
-	pHeader = get_free_block(aligned_size);
+	return pArena->free_lists[fl][sl];
+}
+
+// Smallest block of the list that can hold 'size' bytes, NULL if none
+static header_t *list_best_fit(header_t *pBlock, size_t size)
+{
+	header_t *pBest = NULL;
+
+	for (; pBlock; pBlock = FREE_LINKS(pBlock)->pNextFree)
+		if (pBlock->data.size >= size && (!pBest || pBlock->data.size < pBest->data.size)) {
+			pBest = pBlock;
+			if (pBlock->data.size == size)
+				break;
+		}
+
+	return pBest;
+}
+
+static header_t *find_best_fit(arena_t *pArena, size_t size)
+{
+	unsigned fl, sl;
+	mapping_insert(size, &fl, &sl);
+
+	// The list of the size holds blocks a bit smaller and a bit larger than it
+	header_t *pBest = list_best_fit(pArena->free_lists[fl][sl], size);
+	if (pBest)
+		return pBest;
 
-	// If there is no available space in free list as large as the user requested
-	if (!pHeader) {		
-        coalesce(); // Merge free adjacent spaces
-        pHeader = get_free_block(aligned_size); // Request again
+	// Every block of the next non-empty list fits, the smallest of them is the best
+	uint32_t sl_map = pArena->sl_bitmap[fl] & (~0U << (sl + 1));
+
+	if (!sl_map) {
+		uint64_t fl_map = pArena->fl_bitmap & (~(uint64_t)0 << (fl + 1));
+		if (!fl_map)
+			return NULL;
+
+		fl = __builtin_ctzll(fl_map);
+		sl_map = pArena->sl_bitmap[fl];
 	}
 
-	// Found available space in free list
-	if (pHeader) {
-		// Split it if it is much bigger than the requested size
-		split_block(pHeader, aligned_size);
-		pHeader->data.is_free = 0;	// set it as not-free
-		
-		pthread_mutex_unlock(&global_malloc_lock);
-		return (void*)(pHeader + 1);	// Return this block to the user who requested it
+	return list_best_fit(pArena->free_lists[fl][__builtin_ctz(sl_map)], size);
+}
+
+static header_t *find_first_fit(arena_t *pArena, size_t size)
+{
+	for (chunk_t *pChunk = pArena->pChunks; pChunk; pChunk = pChunk->pNext)
+		for (header_t *pBlock = CHUNK_FIRST_BLOCK(pChunk); !pBlock->data.is_fence; pBlock = next_block(pBlock))
+			if (pBlock->data.is_free && pBlock->data.size >= size)
+				return pBlock;
+
+	return NULL;
+}
+
+static header_t *find_next_fit(arena_t *pArena, size_t size)
+{
+	chunk_t *pChunk = pArena->pRoverChunk;
+	header_t *pStart = pArena->pRover;
+
+	if (!pStart) {
+		if (!(pChunk = pArena->pChunks))
+			return NULL;
+		pStart = CHUNK_FIRST_BLOCK(pChunk);
 	}
 
-	// If there is still no available space in free list, request it from OS using sbrk() syscall
-	if ((pBlock = sbrk(total_size)) == (void *) -1) {
-		pthread_mutex_unlock(&global_malloc_lock);
-		return NULL;
+	header_t *pBlock = pStart;
+
+	do {
+		// End of a chunk: go on with the next one, or back to the first
+		if (pBlock->data.is_fence) {
+			pChunk = pChunk->pNext ? pChunk->pNext : pArena->pChunks;
+			pBlock = CHUNK_FIRST_BLOCK(pChunk);
+			continue;
+		}
+
+		if (pBlock->data.is_free && pBlock->data.size >= size) {
+			pArena->pRover = pBlock;
+			pArena->pRoverChunk = pChunk;
+			return pBlock;
+		}
+
+		pBlock = next_block(pBlock);
+	} while (pBlock != pStart);
+
+	return NULL;
+}
+
+// Returns a free block large enough for 'size' and takes it out of the index
+static header_t *get_free_block(arena_t *pArena, size_t size) 
+{
+	header_t *pBlock;
+
+	switch (placement) {
+	case DALLOC_PLACEMENT_BEST_FIT:
+		pBlock = find_best_fit(pArena, size);
+		break;
+	case DALLOC_PLACEMENT_FIRST_FIT:
+		pBlock = find_first_fit(pArena, size);
+		break;
+	case DALLOC_PLACEMENT_NEXT_FIT:
+		pBlock = find_next_fit(pArena, size);
+		break;
+	default:
+		pBlock = find_good_fit(pArena, size);
+		break;
 	}
 
-	// Create pHeader with new pBlock
-	pHeader = (header_t *)pBlock;
-	pHeader->data.size = aligned_size;	// How much space will be freed up when it is freed in the future?
-	pHeader->data.is_free = 0;
-	pHeader->data.pNext = NULL;
+	if (pBlock)
+		index_remove(pArena, pBlock);
+
+	return pBlock;
+}
+
+// ***********************************************************************
+// Transparent Huge Pages
+// ***********************************************************************
+
+/*
+ * A pointer-chasing workload over a large heap misses the TLB on almost every
+ * step with 4 KiB pages. The kernel can back memory with 2 MiB pages without any
+ * hugetlbfs setup (transparent huge pages), but only for ranges that are
+ * HUGEPAGE_SIZE-aligned and advised with MADV_HUGEPAGE (in the default "madvise"
+ * mode). DALLOC_OPT_HUGEPAGE makes the arenas commit their (aligned) segments in
+ * whole advised huge pages, and puts large blocks on huge page boundaries.
+ *
+ * The kernel still decides: the pages are advised, not guaranteed, and
+ * purging part of a segment (madvise DONTNEED) splits its huge page again.
+ */
+#define HUGEPAGE_SIZE		((size_t)2 << 20)
+
+static int hugepage_enabled;	// 0: normal pages (default), set by dallopt(DALLOC_OPT_HUGEPAGE)
 
-	// Add new pBlock into free (linked) list
-	if (!pHead)
-		pHead = pHeader;	// Add as first element
 
-	if (pTail)
-		pTail->data.pNext = pHeader;	// Link to the end of the old
+// ***********************************************************************
+// Segments (Reserved Address Space)
+// ***********************************************************************
+
+/*
+ * Arenas do not move the program break: glibc malloc or any library may own it,
+ * and memory above a break that someone else moved is not contiguous with ours.
+ * Instead each arena reserves SEGMENT_SIZE bytes of address space with
+ * mmap(PROT_NONE), which costs neither memory nor commit charge, and commits it
+ * front to back with mprotect() as it grows:
+ *
+ *   | committed: chunk(s) of the arena | reserved (PROT_NONE) ... |
+ *   ^ segment                          ^ pCommit                  ^ pReserveEnd
+ *
+ * Every commit continues the arena's newest chunk, so an arena's heap stays one
+ * chunk per segment. When a request does not fit in the rest of the segment, a new
+ * one is reserved (larger, if the request is) and the unused rest of the old one is
+ * given back. Segments are HUGEPAGE_SIZE-aligned, for the huge page mode.
+ *
+ * dalloc_trim() decommits the free end of the newest chunk: a PROT_NONE mapping
+ * placed over it drops its pages and its commit charge at once.
+ */
+#define SEGMENT_SIZE		((size_t)256 << 20)	// Address space reserved per arena at a time
+
+// Reserves 'size' bytes (a multiple of HUGEPAGE_SIZE) of aligned address space, NULL on failure
+static char *segment_reserve(size_t size)
+{
+	// Over-reserve by one huge page and cut both ends down to the aligned segment
+	size_t length = size + HUGEPAGE_SIZE;
+	char *pRaw = mmap(NULL, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	STAT_ADD(mmap_calls, 1);
+	if (pRaw == MAP_FAILED)
+		return NULL;
 
-	pTail = pHeader; 	// Update pTail
+	char *pSegment = (char *)ALIGN_UP((uintptr_t)pRaw, HUGEPAGE_SIZE);
+	if (pSegment > pRaw) {
+		munmap(pRaw, pSegment - pRaw);
+		STAT_ADD(munmap_calls, 1);
+	}
+	if (pSegment + size < pRaw + length) {
+		munmap(pSegment + size, pRaw + length - (pSegment + size));
+		STAT_ADD(munmap_calls, 1);
+	}
 
-	pthread_mutex_unlock(&global_malloc_lock);
-	// return the address after pHeader
-	return (void*)(pHeader + 1);
+	return pSegment;
 }
 
-// *** dcalloc (Clear Allocation)
-void *dcalloc(size_t n, size_t size)
+// Commits at least '*pSize' bytes at the end of the arena's memory (the size used is stored back)
+// Returns them, zero-filled, or NULL if the OS refused. The caller must hold the arena's lock
+static char *segment_commit(arena_t *pArena, size_t *pSize)
 {
-	// Overflow Check ***************************************************************
-	/* 	
-	  It's too late to check after performing multiplication (because it 
-	  will already be overflowing). Therefore, we will perform the check 
-	  by reversing it with division.
-	*/
-	// In Math: 		If (num * size) > SIZE_MAX, there is an overflow. 
-	// Computer Logic: 	If (num > SIZE_MAX / size), there is an overflow. 
-	// 'size == 0' check is to prevent the "Division by Zero" error.
-	if (size != 0 && n > SIZE_MAX / size) {
-		// Overflow! Incorrect memory allocation will occur if the operation is performed. 
-		// Returning a NULL error with an ENOMEM (Not enough memory)
-		errno = ENOMEM;
+	// Huge page mode commits whole huge pages
+	size_t size = ALIGN_UP(*pSize, hugepage_enabled ? HUGEPAGE_SIZE : page_size);
+
+	// Full, or reserved before the huge page mode changed: start a new segment
+	if (size > (size_t)(pArena->pReserveEnd - pArena->pCommit) || pArena->segment_huge != hugepage_enabled) {
+		size_t reserve = size > SEGMENT_SIZE ? ALIGN_UP(size, HUGEPAGE_SIZE) : SEGMENT_SIZE;
+		char *pSegment = segment_reserve(reserve);
+		if (!pSegment)
+			return NULL;
+
+		if (pArena->pCommit < pArena->pReserveEnd) {
+			munmap(pArena->pCommit, pArena->pReserveEnd - pArena->pCommit);
+			STAT_ADD(munmap_calls, 1);
+		}
+
+		pArena->pCommit = pSegment;
+		pArena->pReserveEnd = pSegment + reserve;
+		pArena->segment_huge = hugepage_enabled;
+	}
+
+	char *pMemory = pArena->pCommit;
+
+	int failed = mprotect(pMemory, size, PROT_READ | PROT_WRITE);
+	STAT_ADD(mprotect_calls, 1);
+	if (failed)
 		return NULL;
+
+#ifdef MADV_HUGEPAGE
+	if (pArena->segment_huge) {
+		madvise(pMemory, size, MADV_HUGEPAGE);
+		STAT_ADD(madvise_calls, 1);
+		STAT_ADD(hugepage_advised_bytes, size);
 	}
+#endif
 
-	// Calculate total size (It's safe now)
-	size_t total = n * size;
+	pArena->pCommit += size;
+	STAT_ADD(heap_bytes, size);
 
-	// Allocate using dalloc
-	void *ptr;
+	*pSize = size;
+	return pMemory;
+}
 
-	if ((ptr = dalloc(total)) != NULL)
-		memset(ptr, 0, total);
-	
-	return ptr;
+// Gives the committed memory from 'pFrom' (page-aligned) to the end of the arena's memory back
+// Returns 1 on success. The caller must hold the arena's lock
+static int segment_decommit(arena_t *pArena, char *pFrom)
+{
+	size_t size = pArena->pCommit - pFrom;
+
+	// A fresh reserved mapping replaces the pages: nothing of them stays in memory or in the commit charge
+	void *pMap = mmap(pFrom, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+	STAT_ADD(mmap_calls, 1);
+	if (pMap == MAP_FAILED)
+		return 0;
+
+	if (pArena->segment_huge)
+		STAT_SUB(hugepage_advised_bytes, size);
+
+	pArena->pCommit = pFrom;
+	STAT_SUB(heap_bytes, size);
+
+	return 1;
 }
 
-void *drealloc(void *ptr, size_t size)
+// Adds at least 'aligned_size' bytes of new memory from the arena's segment to the arena.
+// Returns it as one free block that is already in the index, or NULL if the OS refused.
+// The caller must hold the arena's lock
+static header_t *arena_grow(arena_t *pArena, size_t aligned_size)
 {
-	// if ptr is NULL, behave like malloc
-	if (!ptr)
-		return dalloc(size);
+	char *pMemory;
+	header_t *pHeader;
 
-	pthread_mutex_lock(&global_malloc_lock);
+	// Room for a new chunk: chunk record, block header, the block, closing fence
+	size_t total_size = CHUNK_HEADER_SIZE + sizeof(header_t) + aligned_size + sizeof(header_t);
 
-	// if size is 0, behave like free
-	if (size == 0) {
-		dfree(ptr);
-		pthread_mutex_unlock(&global_malloc_lock);
+	// Small requests take a whole growth step, the rest is left free for the next ones
+	if (total_size < ARENA_GROW_SIZE)
+		total_size = ARENA_GROW_SIZE;
+
+	pMemory = segment_commit(pArena, &total_size);
+	if (!pMemory)
 		return NULL;
+
+	if (pArena->pTop && pMemory == (char *)(pArena->pTop + 1)) {
+		// Same segment as the last growth: continue the newest chunk.
+		// Its fence becomes the header of the new block (prev_size is already right).
+		pHeader = pArena->pTop;
+		pHeader->data.is_fence = 0;
+		pHeader->data.size = total_size - sizeof(header_t);
 	}
+	else {
+		// Start a new chunk
+		chunk_t *pChunk = (chunk_t *)pMemory;
+		pChunk->pNext = pArena->pChunks;
+		pArena->pChunks = pChunk;
 
-	// Get the current header
-	header_t *pHeader = (header_t *)ptr - 1;
-	size_t aligned_size = ALIGN(size);
+		pHeader = (header_t *)(pMemory + CHUNK_HEADER_SIZE);
+		*pHeader = (header_t){ .data = { .arena = pArena - arenas } };
+		pHeader->data.size = total_size - CHUNK_HEADER_SIZE - 2 * sizeof(header_t);
+	}
 
+	// Close the chunk with a fence
+	header_t *pFence = next_block(pHeader);
+	*pFence = (header_t){ .data = { .is_fence = 1, .arena = pArena - arenas } };
+	pFence->data.prev_size = pHeader->data.size;
+	pArena->pTop = pFence;
 
-	// Scenario A: Shrinking ************************************************
-	if (pHeader->data.size >= aligned_size + sizeof(header_t) + ALIGNMENT) {
-		// The split_block function divides the block and attaches the remaining part to the header->next
-		split_block(pHeader, aligned_size);
+	// Newly committed pages are zero-filled by the kernel
+	pHeader->data.is_free = 1;
+	pHeader->data.is_fresh = 1;
+	index_insert(pArena, pHeader);
 
-		// Now try merging that newly formed remainder with its neighbor on the right.
-        header_t *pRemainder = pHeader->data.pNext;       // Newly formed free space
-        header_t *pNeighbor = pRemainder->data.pNext;     // The neighbor to its right
+	// The old last block of the chunk is free: merge
+	header_t *pPrev = prev_block(pHeader);
+	if (pPrev && pPrev->data.is_free) {
+		merge_next(pArena, pPrev);
+		return pPrev;
+	}
 
-        // Is there a neighbor? AND Is the neighbor's space is free
-        if (pNeighbor && pNeighbor->data.is_free)
-			// Merge remainder and neighbor
-			merge_next(pRemainder);
+	return pHeader;
+}
 
-		pthread_mutex_unlock(&global_malloc_lock);
-        return ptr;
-	}
+// Takes a block of 'aligned_size' bytes from the arena (free index first, then a new commit)
+// '*pFresh' (if not NULL) tells whether its payload is still zero, apart from FREE_DIRTY_SIZE bytes.
+// The caller must hold the arena's lock
+static header_t *heap_alloc(arena_t *pArena, size_t aligned_size, int *pFresh)
+{
+	// Search in the free list for recycled space
+	// No merge and retry on a miss: dfree() merges with both neighbours on every call,
+	// so the heap never holds two adjacent free blocks and a second search could not succeed.
+	header_t *pHeader = get_free_block(pArena, aligned_size);
 
-	// Scenario B: Expansion ************************************************
-	// If it hasn't shrunk, maybe we can expand it in place?
-	// Current size + header + adjacent size >= Requested size?
-	header_t *pNext = pHeader->data.pNext;
+	// If there is still no available space in free list, grow the arena
+	if (!pHeader) {
+		if (!(pHeader = arena_grow(pArena, aligned_size)))
+			return NULL;
 
-	if (pNext && pNext->data.is_free && pHeader->data.size + sizeof(header_t) + pNext->data.size >= aligned_size) {
-		merge_next(pHeader);
-		pthread_mutex_unlock(&global_malloc_lock);
-		return ptr;
+		index_remove(pArena, pHeader);
 	}
 
-	// Scenario C: Relocation ***********************************************
-	// No free space to expand, so we'll have to reallocate it
-	void *pNewBlock = dalloc(size);
+	// Split it if it is much bigger than the requested size
+	split_block(pArena, pHeader, aligned_size);
+	pHeader->data.is_free = 0;	// set it as not-free
 
-	if (pNewBlock) {
-		memcpy(pNewBlock, ptr, pHeader->data.size);
-		dfree(ptr);
+	// From now on the user writes to it
+	if (pFresh)
+		*pFresh = pHeader->data.is_fresh;
+	pHeader->data.is_fresh = 0;
+		
+	return pHeader;	// Return this block to the user who requested it
+}
+
+#define BATCH_REGION_SIZE	(256 * 1024)	// Largest region cut into blocks at once by heap_alloc_batch()
+
+// Takes 'count' blocks of 'aligned_size' bytes, cutting each group of them from one
+// region: one index search and one split per region instead of one per block.
+// Returns how many blocks were stored in 'ppOut' (fewer than 'count' if the OS refused memory).
+// The caller must hold the arena's lock
+static size_t heap_alloc_batch(arena_t *pArena, size_t aligned_size, size_t count, void **ppOut)
+{
+	size_t stride = sizeof(header_t) + aligned_size;
+	size_t per_region = stride < BATCH_REGION_SIZE ? BATCH_REGION_SIZE / stride : 1;
+	size_t done = 0;
+
+	while (done < count) {
+		size_t n = count - done < per_region ? count - done : per_region;
+
+		// Region for n blocks: the first header is the region's own header
+		header_t *pBlock = heap_alloc(pArena, n * stride - sizeof(header_t), NULL);
+		if (!pBlock)
+			break;
+
+		// Cut the region from the front; the last block keeps any slack heap_alloc did not split off
+		for (size_t i = 1; i < n; ++i) {
+			header_t *pNext = (header_t *)((char *)(pBlock + 1) + aligned_size);
+
+			*pNext = (header_t){ .data = { .prev_size = aligned_size, .arena = pBlock->data.arena } };
+			set_size(pNext, pBlock->data.size - stride);
+			pBlock->data.size = aligned_size;
+
+			ppOut[done++] = pBlock + 1;
+			pBlock = pNext;
+		}
+
+		ppOut[done++] = pBlock + 1;
 	}
 
-	pthread_mutex_unlock(&global_malloc_lock);
-	return pNewBlock;
+	return done;
 }
 
-void dfree(void *pBlock)
+// Takes a block whose payload is a multiple of 'alignment' (a power of two above ALIGNMENT)
+// The caller must hold the arena's lock
+static header_t *heap_alloc_aligned(arena_t *pArena, size_t alignment, size_t aligned_size)
 {
-	if (!pBlock)
-		return;
+	// Worst case: the payload is moved up by almost 'alignment', after leaving room
+	// for a leading free block (header + ALIGNMENT) in front of it
+	size_t search_size = aligned_size + alignment + sizeof(header_t) + ALIGNMENT;
 
-	pthread_mutex_lock(&global_malloc_lock);
-	// Go back to pHeader using pointer arithmetic
-	// We gave the user (pHeader + 1), now we are returning 1.
-	header_t *pHeader = (header_t *)pBlock - 1;
-	pHeader->data.is_free = 1;
+	header_t *pBlock = get_free_block(pArena, search_size);
 
-	coalesce();
-	
-	pthread_mutex_unlock(&global_malloc_lock);
+	if (!pBlock) {
+		if (!(pBlock = arena_grow(pArena, search_size)))
+			return NULL;
+
+		index_remove(pArena, pBlock);
+	}
+
+	header_t *pHeader = pBlock;
+
+	// Not aligned by luck: place the header so that the payload is aligned and
+	// the slack in front of it is large enough to stay as a free block
+	if ((uintptr_t)(pBlock + 1) & (alignment - 1)) {
+		uintptr_t payload = ALIGN_UP((uintptr_t)(pBlock + 1) + sizeof(header_t) + ALIGNMENT, alignment);
+		pHeader = (header_t *)payload - 1;
+
+		// Cut the block at pHeader: leading slack | aligned block
+		size_t lead = (char *)pHeader - (char *)(pBlock + 1);
+
+		*pHeader = (header_t){ .data = { .is_fresh = pBlock->data.is_fresh, .prev_size = lead, .arena = pBlock->data.arena } };
+		set_size(pHeader, pBlock->data.size - lead - sizeof(header_t));
+		pBlock->data.size = lead;
+
+		// The slack goes back to the index
+		// (its left neighbour is not free, the heap never has two free blocks side by side)
+		index_insert(pArena, pBlock);
+	}
+
+	// Cut the unused end off, as a normal allocation would
+	split_block(pArena, pHeader, aligned_size);
+	pHeader->data.is_free = 0;
+	pHeader->data.is_fresh = 0;
+
+	return pHeader;
+}
+
+// Gives a block back to its arena
+// Only its two physical neighbours are checked for merging, the heap is never walked.
+// The caller must hold the arena's lock
+static void heap_free(arena_t *pArena, header_t *pHeader)
+{
+	// The right neighbour is free: absorb it
+	// (pHeader is still marked as used here, so merge_next() does not look for it in the index)
+	if (next_block(pHeader)->data.is_free)
+		merge_next(pArena, pHeader);
+
+	// The left neighbour is free: it absorbs us and goes back to the index with its new size
+	header_t *pPrev = prev_block(pHeader);
+	if (pPrev && pPrev->data.is_free) {
+		merge_next(pArena, pPrev);
+		return;
+	}
+
+	pHeader->data.is_free = 1;
+	pHeader->data.is_fresh = 0;
+	pHeader->data.is_sampled = 0;
+	index_insert(pArena, pHeader);
+}
+
+// ***********************************************************************
+// Slabs (Small Size Classes)
+// ***********************************************************************
+
+/*
+ * Requests up to SLAB_MAX_SIZE bytes are rounded up to a 16-byte size class and
+ * served from slabs: page-sized runs of equal objects with no per-object header.
+ * A small header at the start of each slab keeps a bitmap of its free slots.
+ *
+ * All slabs are cut from one large address range reserved at first use, so a
+ * pointer is known to be a slab object with a range check, and its slab is found
+ * by rounding the address down to SLAB_SIZE. The range is only address space:
+ * pages are committed SLAB_COMMIT_SIZE at a time as slabs are cut.
+ *
+ * Each arena keeps its partial (neither full nor empty) slabs per class. Empty
+ * slabs go to a global stack and are reused before new ones are cut;
+ * dalloc_trim() releases their pages with madvise().
+ */
+#define SLAB_SIZE			4096
+#define SLAB_REGION_SIZE	((size_t)4 << 30)	// 4 GiB of address space, 1M slabs
+#define SLAB_COMMIT_SIZE	(256 * 1024)
+#define SLAB_BITMAP_WORDS	4					// 256 slots, enough for the 16-byte class
+
+typedef struct slab {
+	struct slab *pNext;		// Partial slabs of the same class and arena
+	struct slab *pPrev;
+	uint32_t size;			// Object size of the class
+	uint32_t arena;			// Index of the owner arena
+	uint16_t capacity;		// Objects in the slab
+	uint16_t used;			// Objects handed out
+	uint64_t free_map[SLAB_BITMAP_WORDS];	// 1: slot is free
+} slab_t;
+
+#define SLAB_HEADER_SIZE	ALIGN(sizeof(slab_t))	// Objects start here, 16-byte aligned
+
+static char *pSlabBase;			// Start of the reserved range, NULL until the first slab
+static size_t slab_cut;			// Bytes of the range already cut into slabs
+static size_t slab_committed;	// Bytes of the range that are readable/writable
+
+// Empty slabs, as slab indexes. Entries below slab_purged_top were already released.
+static uint32_t *pSlabStack;
+static size_t slab_top;
+static size_t slab_purged_top;
+
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static int slab_enabled = 1;	// Changed by dallopt(DALLOC_OPT_SLAB)
+
+static inline unsigned slab_class(size_t aligned_size)
+{
+	return aligned_size / ALIGNMENT - 1;
+}
+
+// Returns the slab of the pointer, or NULL if it is not a slab object
+static inline slab_t *slab_of(void *ptr)
+{
+	char *pBase = __atomic_load_n(&pSlabBase, __ATOMIC_ACQUIRE);
+
+	if (!pBase || (char *)ptr < pBase || (char *)ptr >= pBase + SLAB_REGION_SIZE)
+		return NULL;
+
+	return (slab_t *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+// Reserves the slab range and the stack of empty slabs (address space only)
+// The caller must hold slab_lock
+static int slab_reserve(void)
+{
+	size_t stack_size = SLAB_REGION_SIZE / SLAB_SIZE * sizeof(uint32_t);
+
+	STAT_ADD(mmap_calls, 2);
+	void *pRange = mmap(NULL, SLAB_REGION_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (pRange == MAP_FAILED)
+		return 0;
+
+	void *pStack = mmap(NULL, stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (pStack == MAP_FAILED) {
+		munmap(pRange, SLAB_REGION_SIZE);
+		return 0;
+	}
+
+	pSlabStack = pStack;
+	// Published last: slab_of() may read it without the lock
+	__atomic_store_n(&pSlabBase, (char *)pRange, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+// Takes an empty slab (a reused one, or a new one cut from the range) for a class of the arena
+static slab_t *slab_new(arena_t *pArena, size_t size)
+{
+	slab_t *pSlab = NULL;
+
+	pthread_mutex_lock(&slab_lock);
+
+	if (!pSlabBase && !slab_reserve()) {
+		// No address space for slabs, small requests fall back to the heap
+		slab_enabled = 0;
+	}
+	else if (slab_top) {
+		pSlab = (slab_t *)(pSlabBase + (size_t)pSlabStack[--slab_top] * SLAB_SIZE);
+		if (slab_purged_top > slab_top)
+			slab_purged_top = slab_top;
+	}
+	else if (slab_cut < SLAB_REGION_SIZE) {
+		// Commit the next piece of the range when the cut reaches its end
+		if (slab_cut == slab_committed) {
+			if (mprotect(pSlabBase + slab_committed, SLAB_COMMIT_SIZE, PROT_READ | PROT_WRITE) == 0)
+				slab_committed += SLAB_COMMIT_SIZE;
+		}
+
+		if (slab_cut < slab_committed) {
+			pSlab = (slab_t *)(pSlabBase + slab_cut);
+			slab_cut += SLAB_SIZE;
+		}
+	}
+
+	pthread_mutex_unlock(&slab_lock);
+
+	if (!pSlab)
+		return NULL;
+
+	pSlab->pNext = pSlab->pPrev = NULL;
+	pSlab->size = size;
+	pSlab->arena = pArena - arenas;
+	pSlab->capacity = (SLAB_SIZE - SLAB_HEADER_SIZE) / size;
+	pSlab->used = 0;
+
+	// Mark the first 'capacity' slots as free
+	for (unsigned w = 0; w < SLAB_BITMAP_WORDS; ++w) {
+		unsigned first = w * 64;
+
+		if (pSlab->capacity >= first + 64)
+			pSlab->free_map[w] = ~(uint64_t)0;
+		else if (pSlab->capacity > first)
+			pSlab->free_map[w] = ((uint64_t)1 << (pSlab->capacity - first)) - 1;
+		else
+			pSlab->free_map[w] = 0;
+	}
+
+	return pSlab;
+}
+
+// Puts an empty slab on the stack for reuse
+static void slab_release(slab_t *pSlab)
+{
+	pthread_mutex_lock(&slab_lock);
+	pSlabStack[slab_top++] = ((char *)pSlab - pSlabBase) / SLAB_SIZE;
+	pthread_mutex_unlock(&slab_lock);
+}
+
+// Releases the pages of the empty slabs that were not released yet
+static int slab_purge(void)
+{
+	int released = 0;
+
+	pthread_mutex_lock(&slab_lock);
+
+	for (; slab_purged_top < slab_top; ++slab_purged_top) {
+		char *pSlab = pSlabBase + (size_t)pSlabStack[slab_purged_top] * SLAB_SIZE;
+		released |= madvise(pSlab, SLAB_SIZE, MADV_DONTNEED) == 0;
+		STAT_ADD(madvise_calls, 1);
+	}
+
+	pthread_mutex_unlock(&slab_lock);
+
+	return released;
+}
+
+static void slab_link(slab_t **ppHead, slab_t *pSlab)
+{
+	pSlab->pPrev = NULL;
+	pSlab->pNext = *ppHead;
+	if (*ppHead)
+		(*ppHead)->pPrev = pSlab;
+	*ppHead = pSlab;
+}
+
+static void slab_unlink(slab_t **ppHead, slab_t *pSlab)
+{
+	if (pSlab->pPrev)
+		pSlab->pPrev->pNext = pSlab->pNext;
+	else
+		*ppHead = pSlab->pNext;
+
+	if (pSlab->pNext)
+		pSlab->pNext->pPrev = pSlab->pPrev;
+}
+
+// Takes one object of the size class from the arena's slabs
+// The caller must hold the arena's lock
+static void *slab_alloc(arena_t *pArena, size_t aligned_size)
+{
+	slab_t **ppHead = &pArena->pSlabs[slab_class(aligned_size)];
+	slab_t *pSlab = *ppHead;
+
+	if (!pSlab) {
+		if (!(pSlab = slab_new(pArena, aligned_size)))
+			return NULL;
+
+		slab_link(ppHead, pSlab);
+	}
+
+	// A partial slab always has a free slot
+	unsigned w = 0;
+	while (!pSlab->free_map[w])
+		++w;
+
+	unsigned slot = w * 64 + __builtin_ctzll(pSlab->free_map[w]);
+	pSlab->free_map[w] &= pSlab->free_map[w] - 1;	// Clear the lowest set bit
+
+	// Full: nothing to offer anymore, leave the partial list
+	if (++pSlab->used == pSlab->capacity)
+		slab_unlink(ppHead, pSlab);
+
+	return (char *)pSlab + SLAB_HEADER_SIZE + (size_t)slot * pSlab->size;
+}
+
+// Gives an object back to its slab
+// The caller must hold the lock of the slab's arena
+static void slab_free(slab_t *pSlab, void *ptr)
+{
+	arena_t *pArena = &arenas[pSlab->arena];
+	slab_t **ppHead = &pArena->pSlabs[slab_class(pSlab->size)];
+	unsigned slot = ((char *)ptr - (char *)pSlab - SLAB_HEADER_SIZE) / pSlab->size;
+
+	pSlab->free_map[slot / 64] |= (uint64_t)1 << (slot % 64);
+
+	// Was full: it has a free slot again
+	if (pSlab->used-- == pSlab->capacity)
+		slab_link(ppHead, pSlab);
+
+	// Empty: give it back, unless it is the only slab left for the class
+	if (!pSlab->used && (pSlab->pNext || pSlab->pPrev)) {
+		slab_unlink(ppHead, pSlab);
+		slab_release(pSlab);
+	}
+}
+
+// Size a pointer handed out by dalloc can hold
+static inline size_t block_size(void *ptr, slab_t *pSlab)
+{
+	return pSlab ? pSlab->size : ((header_t *)ptr - 1)->data.size;
+}
+
+// Takes 'aligned_size' bytes from the arena: a slab object if the size is small, a heap block otherwise
+// '*pFresh' (if not NULL) tells whether the memory is still zero, apart from FREE_DIRTY_SIZE bytes.
+// The caller must hold the arena's lock
+static void *arena_alloc(arena_t *pArena, size_t aligned_size, int *pFresh)
+{
+	if (aligned_size <= SLAB_MAX_SIZE && slab_enabled) {
+		void *ptr = slab_alloc(pArena, aligned_size);
+		if (ptr) {
+			if (pFresh)
+				*pFresh = 0;
+			return ptr;
+		}
+	}
+
+	header_t *pHeader = heap_alloc(pArena, aligned_size, pFresh);
+
+	return pHeader ? (void *)(pHeader + 1) : NULL;
+}
+
+// Gives a slab object or a heap block back to the arena
+// The caller must hold the arena's lock
+static void arena_free(arena_t *pArena, void *ptr)
+{
+	slab_t *pSlab = slab_of(ptr);
+
+	if (pSlab)
+		slab_free(pSlab, ptr);
+	else
+		heap_free(pArena, (header_t *)ptr - 1);
+}
+
+// Arena that owns a slab object or a heap block
+static inline arena_t *owner_arena(void *ptr, slab_t *pSlab)
+{
+	return pSlab ? &arenas[pSlab->arena] : block_arena((header_t *)ptr - 1);
+}
+
+// ***********************************************************************
+// Remote Frees (Lock-Free Queue)
+// ***********************************************************************
+
+/*
+ * In a producer/consumer program, the consumer frees blocks of the producer's
+ * arena while the producer is allocating from it. Instead of waiting for the
+ * lock, dfree() pushes the block onto the arena's queue with one CAS and
+ * returns. The next thread that takes the lock (arena_lock) frees the whole
+ * queue at once.
+ *
+ * The queue is a LIFO list linked through the first word of the blocks, like
+ * the thread cache. It is only pushed to and emptied as a whole with an
+ * exchange, never popped one by one, so it has no ABA problem.
+ */
+#define REMOTE_NEXT(ptr) (*(void **)(ptr))
+
+// Queues a slab object or a heap block of the arena, without its lock
+static void remote_push(arena_t *pArena, void *ptr)
+{
+	void *pHead = __atomic_load_n(&pArena->pRemoteFrees, __ATOMIC_RELAXED);
+
+	do
+		REMOTE_NEXT(ptr) = pHead;
+	while (!__atomic_compare_exchange_n(&pArena->pRemoteFrees, &pHead, ptr, 1,
+										__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	STAT_ADD(remote_frees, 1);
+}
+
+// Frees every queued block
+// The caller must hold the arena's lock
+static void remote_drain(arena_t *pArena)
+{
+	void *ptr = __atomic_exchange_n(&pArena->pRemoteFrees, NULL, __ATOMIC_ACQUIRE);
+
+	while (ptr) {
+		void *pNext = REMOTE_NEXT(ptr);
+		arena_free(pArena, ptr);
+		ptr = pNext;
+	}
+}
+
+// ***********************************************************************
+// Giving Memory Back to the OS (trim & decay)
+// ***********************************************************************
+
+/*
+ * Two ways of shrinking RSS without touching blocks that are in use:
+ *
+ * - Trim:  when the last block of an arena is free, the pages at the end of
+ *          it are decommitted (given back to the segment's reserve).
+ * - Purge: the whole pages inside a large free block are released with
+ *          madvise(MADV_DONTNEED). The block stays in the heap; its pages
+ *          are faulted back in (zero-filled) when it is used again.
+ *          Empty slabs are released the same way.
+ *
+ * dalloc_trim() does both right away. With DALLOC_OPT_DECAY_MS, a background
+ * thread purges only blocks that stayed free for that long, so a short dip in
+ * load does not pay for faulting the pages back in.
+ */
+// Releases the pages inside a free block, its header, links and stamp stay in place
+static int purge_block(header_t *pBlock)
+{
+	uintptr_t start = PAGE_ALIGN((uintptr_t)(FREE_LINKS(pBlock) + 1) + sizeof(uint64_t));
+	uintptr_t end = ((uintptr_t)(pBlock + 1) + pBlock->data.size) & ~(page_size - 1);
+
+	pBlock->data.is_purged = 1;
+
+	if (start >= end)
+		return 0;
+
+	STAT_ADD(madvise_calls, 1);
+	return madvise((void *)start, end - start, MADV_DONTNEED) == 0;
+}
+
+// Purges the free blocks of the arena that have been free for at least 'age' ms (0: all)
+// The caller must hold the arena's lock
+static int arena_purge(arena_t *pArena, unsigned age)
+{
+	unsigned fl, sl;
+	uint64_t now = now_ms();
+	int released = 0;
+
+	// Blocks smaller than PURGE_MIN_SIZE can not hold a whole page, skip their lists
+	mapping_insert(PURGE_MIN_SIZE, &fl, &sl);
+
+	for (; fl < FL_COUNT; ++fl, sl = 0) {
+		if (!(pArena->fl_bitmap & ((uint64_t)1 << fl)))
+			continue;
+
+		for (; sl < SL_COUNT; ++sl) {
+			for (header_t *pBlock = pArena->free_lists[fl][sl]; pBlock; pBlock = FREE_LINKS(pBlock)->pNextFree) {
+				if (pBlock->data.is_purged || pBlock->data.size < PURGE_MIN_SIZE)
+					continue;
+				if (age && now - FREE_STAMP(pBlock) < age)
+					continue;
+
+				released |= purge_block(pBlock);
+			}
+		}
+	}
+
+	return released;
+}
+
+// Decommits the end of the arena's last block if it is free and ends its segment's committed memory.
+// At least 'pad' bytes of the block are kept.
+// The caller must hold the arena's lock
+static int arena_trim_tail(arena_t *pArena, size_t pad)
+{
+	header_t *pTop = pArena->pTop;
+	int released = 0;
+
+	if (!pTop)
+		return 0;
+
+	header_t *pTail = prev_block(pTop);
+	if (!pTail || !pTail->data.is_free)
+		return 0;
+
+	char *pEnd = (char *)(pTop + 1);
+	// Keep the header, the free links, 'pad' and the fence, up to the end of their page
+	// (of their huge page in huge page mode, so the rest of the segment stays aligned)
+	char *pKeep = (char *)PAGE_ALIGN((uintptr_t)(FREE_LINKS(pTail) + 1) + sizeof(uint64_t) + pad + sizeof(header_t));
+	if (pArena->segment_huge)
+		pKeep = (char *)ALIGN_UP((uintptr_t)pKeep, HUGEPAGE_SIZE);
+
+	// Only the end of the current segment can be decommitted
+	if (pKeep < pEnd && pEnd == pArena->pCommit && segment_decommit(pArena, pKeep)) {
+		index_remove(pArena, pTail);
+		pTail->data.size = pKeep - (char *)(pTail + 1) - sizeof(header_t);
+		index_insert(pArena, pTail);
+
+		// The fence moves down with the commit
+		pTop = next_block(pTail);
+		*pTop = (header_t){ .data = { .is_fence = 1, .prev_size = pTail->data.size, .arena = pTail->data.arena } };
+		pArena->pTop = pTop;
+		released = 1;
+	}
+
+	return released;
+}
+
+int dalloc_trim(size_t pad)
+{
+	dalloc_init();
+
+	int released = 0;
+
+	for (unsigned i = 0; i < ARENA_MAX; ++i) {
+		arena_t *pArena = &arenas[i];
+
+		arena_lock(pArena);
+		released |= arena_trim_tail(pArena, pad);
+		released |= arena_purge(pArena, 0);
+		pthread_mutex_unlock(&pArena->lock);
+	}
+
+	released |= slab_purge();
+
+	return released;
+}
+
+// Background thread: purges memory that stayed free for longer than decay_ms
+static void *purger_routine(void *arg)
+{
+	(void)arg;
+
+	for (;;) {
+		unsigned decay = decay_ms;
+
+		// Check twice per decay period, so nothing stays free much longer than that
+		// (in 64 bits: in microseconds, a period of more than 2.4 hours would wrap)
+		uint64_t delay_ms = decay ? (uint64_t)decay / 2 + 1 : 1000;
+		struct timespec delay = { .tv_sec = delay_ms / 1000, .tv_nsec = (delay_ms % 1000) * 1000000 };
+		nanosleep(&delay, NULL);
+
+		if (!decay)
+			continue;
+
+		// All of them: threads keep their arena when DALLOC_OPT_ARENA_COUNT is lowered
+		for (unsigned i = 0; i < ARENA_MAX; ++i) {
+			arena_t *pArena = &arenas[i];
+
+			// Never used (a heap is never given back, a stale read only delays it one round)
+			if (!pArena->pChunks)
+				continue;
+
+			arena_lock(pArena);
+			arena_purge(pArena, decay);
+			pthread_mutex_unlock(&pArena->lock);
+		}
+	}
+
+	return NULL;
+}
+
+// Starts the purger thread once, the first time decay is turned on (again in a forked child).
+// The flag is claimed first: purger_lock is not held across pthread_create(), which allocates
+static int purger_start(void)
+{
+	pthread_mutex_lock(&purger_lock);
+	int start = !purger_started;
+	purger_started = 1;
+	pthread_mutex_unlock(&purger_lock);
+
+	if (!start)
+		return 1;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, purger_routine, NULL) != 0) {
+		purger_started = 0;
+		return 0;
+	}
+
+	pthread_detach(thread);
+	return 1;
+}
+
+// ***********************************************************************
+// Large Blocks (mmap)
+// ***********************************************************************
+
+/*
+ * Requests of at least mmap_threshold bytes do not come from the arenas.
+ * Each one gets its own anonymous mapping and is given back to the kernel with
+ * munmap() as soon as it is freed, so a big buffer neither fragments the arena
+ * heap nor pins the memory above it. Such blocks have is_mmapped set.
+ *
+ * The mapping always starts at the page that holds the header, so the block
+ * can be unmapped without storing the mapping's address anywhere else.
+ *
+ * A mmap()/munmap() pair per block is slow for a program that allocates and
+ * frees buffers of the same large size over and over. Like glibc, freeing a
+ * mapped block raises the threshold to its size (up to MMAP_THRESHOLD_MAX):
+ * the next requests of that size are served by the arenas, which keep and
+ * reuse the memory. Setting DALLOC_OPT_MMAP_THRESHOLD turns this off.
+ */
+#define MMAP_THRESHOLD		(128 * 1024)	// Default, changed by dallopt(DALLOC_OPT_MMAP_THRESHOLD)
+#define MMAP_THRESHOLD_MAX	(32 * 1024 * 1024)
+
+static size_t mmap_threshold = MMAP_THRESHOLD;
+static int mmap_threshold_fixed;	// Set by dallopt(), the threshold no longer moves
+
+// Maps a block whose payload is a multiple of 'alignment' (ALIGNMENT for plain requests)
+static header_t *mmap_alloc(size_t aligned_size, size_t alignment)
+{
+	// Huge page mode: a block of a huge page or more covers whole, aligned huge pages
+	int huge = hugepage_enabled && aligned_size >= HUGEPAGE_SIZE;
+	if (huge) {
+		aligned_size = ALIGN_UP(aligned_size, HUGEPAGE_SIZE);
+		if (alignment < HUGEPAGE_SIZE)
+			alignment = HUGEPAGE_SIZE;
+	}
+
+	// Over-map by the alignment, so an aligned payload fits wherever the mapping lands
+	size_t extra = alignment > ALIGNMENT ? alignment : 0;
+	size_t length = PAGE_ALIGN(sizeof(header_t) + aligned_size + extra);
+
+	char *pMap = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	STAT_ADD(mmap_calls, 1);
+	if (pMap == MAP_FAILED)
+		return NULL;
+
+	// Payload right after the header, moved up to the alignment if needed
+	char *pPayload = (char *)ALIGN_UP((uintptr_t)pMap + sizeof(header_t), alignment);
+	char *pStart = (char *)((uintptr_t)(pPayload - sizeof(header_t)) & ~(page_size - 1));
+	char *pEnd = (char *)PAGE_ALIGN((uintptr_t)pPayload + aligned_size);
+
+	// Give the unused pages at both ends back, the mapping must start at the header's page
+	if (pStart > pMap) {
+		munmap(pMap, pStart - pMap);
+		STAT_ADD(munmap_calls, 1);
+	}
+	if (pEnd < pMap + length) {
+		munmap(pEnd, pMap + length - pEnd);
+		STAT_ADD(munmap_calls, 1);
+	}
+
+	STAT_ADD(mmap_bytes, pEnd - pStart);
+	STAT_ADD(mmap_blocks, 1);
+
+	header_t *pHeader = (header_t *)pPayload - 1;
+	*pHeader = (header_t){ .data = { .is_mmapped = 1 } };
+	pHeader->data.size = pEnd - pPayload;	// The rounding up to a page is usable too
+
+#ifdef MADV_HUGEPAGE
+	if (huge) {
+		// The header's page stays a normal one, the payload starts on a huge page
+		madvise(pPayload, aligned_size, MADV_HUGEPAGE);
+		STAT_ADD(madvise_calls, 1);
+		STAT_ADD(hugepage_advised_bytes, aligned_size);
+		pHeader->data.is_huge = 1;
+	}
+#endif
+
+	return pHeader;
+}
+
+#ifdef MREMAP_MAYMOVE
+// Resizes a mapped block with mremap(): the kernel moves page table entries, not
+// the bytes, so growing costs the same for 1 MiB and for 1 GiB. The header keeps
+// its offset in the first page. Returns the (maybe moved) header, or NULL.
+static header_t *mmap_resize(header_t *pHeader, size_t aligned_size)
+{
+	char *pMap = (char *)((uintptr_t)pHeader & ~(page_size - 1));
+	size_t offset = (char *)pHeader - pMap;
+	size_t old_length = offset + sizeof(header_t) + pHeader->data.size;
+	size_t length = PAGE_ALIGN(offset + sizeof(header_t) + aligned_size);
+
+	char *pNew = mremap(pMap, old_length, length, MREMAP_MAYMOVE);
+	STAT_ADD(mremap_calls, 1);
+	if (pNew == MAP_FAILED)
+		return NULL;
+
+	STAT_ADD(mmap_bytes, length);
+	STAT_SUB(mmap_bytes, old_length);
+
+	pHeader = (header_t *)(pNew + offset);
+
+	// The advice moves with the mapping (a moved block may lose its huge page alignment)
+	if (pHeader->data.is_huge) {
+		STAT_ADD(hugepage_advised_bytes, length);
+		STAT_SUB(hugepage_advised_bytes, old_length);
+	}
+
+	pHeader->data.size = length - offset - sizeof(header_t);
+
+	return pHeader;
+}
+#endif
+
+// Shrinks a mapped block in place: the whole pages past the new size are unmapped
+static void mmap_shrink(header_t *pHeader, size_t aligned_size)
+{
+	char *pPayload = (char *)(pHeader + 1);
+	char *pEnd = pPayload + pHeader->data.size;
+	char *pNewEnd = (char *)PAGE_ALIGN((uintptr_t)pPayload + aligned_size);
+
+	if (pNewEnd >= pEnd)
+		return;
+
+	munmap(pNewEnd, pEnd - pNewEnd);
+
+	STAT_ADD(munmap_calls, 1);
+	STAT_SUB(mmap_bytes, pEnd - pNewEnd);
+	if (pHeader->data.is_huge)
+		STAT_SUB(hugepage_advised_bytes, pEnd - pNewEnd);
+
+	pHeader->data.size = pNewEnd - pPayload;
+}
+
+static void mmap_free(header_t *pHeader)
+{
+	char *pMap = (char *)((uintptr_t)pHeader & ~(page_size - 1));
+	char *pEnd = (char *)(pHeader + 1) + pHeader->data.size;
+
+	// Dynamic threshold: blocks of this size come from the arenas from now on
+	size_t size = pHeader->data.size;
+	if (!mmap_threshold_fixed && size > __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) && size <= MMAP_THRESHOLD_MAX)
+		__atomic_store_n(&mmap_threshold, size, __ATOMIC_RELAXED);
+
+	if (pHeader->data.is_huge)
+		STAT_SUB(hugepage_advised_bytes, pHeader->data.size);
+
+	munmap(pMap, pEnd - pMap);
+
+	STAT_ADD(munmap_calls, 1);
+	STAT_SUB(mmap_bytes, pEnd - pMap);
+	STAT_SUB(mmap_blocks, 1);
+}
+
+// ***********************************************************************
+// Guarded Sampling (Overflow & Use-After-Free Detection)
+// ***********************************************************************
+
+/*
+ * A buffer overflow into the next block (see hack_demo.c) or a use after free
+ * corrupts the heap silently. Checking every block is too slow for production,
+ * so with DALLOC_OPT_GUARD_RATE = N, one allocation in N of each thread is
+ * placed alone in a page of the guard pool instead:
+ *
+ *   | guard | slot | guard | slot | guard | ... | slot | guard |
+ *
+ * Guard pages are PROT_NONE. The block ends at the end of its slot page (up to
+ * its alignment), so the first byte written or read past it faults. A freed slot
+ * becomes PROT_NONE too, so a use after free faults as well. Freed slots are
+ * reused oldest first, to keep them protected as long as possible.
+ *
+ * The SIGSEGV handler recognizes faults in the pool and prints what happened,
+ * with the block's size and the address its allocation returned to (the
+ * allocation site, to look up in a debugger). Then the signal takes its
+ * normal course (crash, core dump, or the program's own handler).
+ *
+ * Only requests up to a page are sampled. The cost outside of the samples is
+ * one thread-local counter per allocation.
+ */
+#define GUARD_SLOTS			256
+
+typedef struct guard_slot {
+	char *ptr;			// Block handed out from the slot, NULL if it was never used
+	size_t size;		// Requested size
+	void *pAllocSite;	// Return address of the allocating call
+	void *pFreeSite;	// Return address of the dfree() call, NULL while in use
+} guard_slot_t;
+
+static char *pGuardPool;		// NULL until the first sample
+static size_t guard_pool_size;	// 0 until the first sample: no pointer is in the pool
+static guard_slot_t guard_slots[GUARD_SLOTS];
+static unsigned guard_queue[GUARD_SLOTS];	// Free slots, oldest free first (ring buffer)
+static unsigned guard_queue_head;
+static unsigned guard_queue_count;
+static pthread_mutex_t guard_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sigaction guard_prev_action;	// SIGSEGV handler from before ours
+
+static unsigned guard_rate;		// 0: off (default), set by dallopt(DALLOC_OPT_GUARD_RATE)
+static DALLOC_TLS unsigned guard_count;
+
+// Does the pointer point into the guard pool?
+static inline int guard_owns(void *ptr)
+{
+	return (uintptr_t)ptr - (uintptr_t)pGuardPool < guard_pool_size;
+}
+
+// Counts an allocation of the thread, true for every guard_rate-th one
+static inline int guard_tick(void)
+{
+	if (++guard_count < guard_rate)
+		return 0;
+
+	guard_count = 0;
+	return 1;
+}
+
+// Page of slot 'index': pages alternate guard, slot, guard, ...
+static inline char *guard_slot_page(unsigned index)
+{
+	return pGuardPool + (2 * (size_t)index + 1) * page_size;
+}
+
+static void guard_signal_handler(int sig, siginfo_t *pInfo, void *pContext);
+
+// Reserves the pool and installs the fault handler. The caller must hold guard_lock
+static int guard_pool_create(void)
+{
+	size_t size = (2 * GUARD_SLOTS + 1) * page_size;
+
+	char *pPool = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	STAT_ADD(mmap_calls, 1);
+	if (pPool == MAP_FAILED)
+		return 0;
+
+	for (unsigned i = 0; i < GUARD_SLOTS; ++i)
+		guard_queue[i] = i;
+	guard_queue_count = GUARD_SLOTS;
+
+	struct sigaction action = { 0 };
+	action.sa_sigaction = guard_signal_handler;
+	action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGSEGV, &action, &guard_prev_action);
+
+	pGuardPool = pPool;
+	guard_pool_size = size;
+
+	return 1;
+}
+
+// Places a block of 'size' bytes (at most a page) at the end of a free slot, aligned to 'alignment'
+// Returns NULL if every slot is taken: the allocation is then served normally.
+static void *guard_alloc(size_t size, size_t alignment, void *pSite)
+{
+	char *ptr = NULL;
+
+	if (size > page_size || alignment > page_size)
+		return NULL;
+
+	pthread_mutex_lock(&guard_lock);
+
+	if ((pGuardPool || guard_pool_create()) && guard_queue_count) {
+		unsigned index = guard_queue[guard_queue_head];
+		guard_queue_head = (guard_queue_head + 1) % GUARD_SLOTS;
+		guard_queue_count--;
+
+		char *pPage = guard_slot_page(index);
+		if (mprotect(pPage, page_size, PROT_READ | PROT_WRITE) == 0) {
+			// Freed slots were emptied with madvise(), the page reads as zeros
+			ptr = (char *)((uintptr_t)(pPage + page_size - size) & ~(alignment - 1));
+			guard_slots[index] = (guard_slot_t){ .ptr = ptr, .size = size, .pAllocSite = pSite };
+			STAT_ADD(guarded_allocs, 1);
+		}
+		else {
+			// Give the slot back
+			guard_queue[(guard_queue_head + guard_queue_count++) % GUARD_SLOTS] = index;
+		}
+	}
+
+	pthread_mutex_unlock(&guard_lock);
+
+	return ptr;
+}
+
+// Slot of a pointer into the pool, -1 for a guard page
+static inline int guard_slot_index(char *ptr)
+{
+	size_t page = (ptr - pGuardPool) / page_size;
+
+	return page % 2 ? (int)(page / 2) : -1;
+}
+
+// Bytes a guarded block can hold without faulting
+static inline size_t guard_usable_size(void *ptr)
+{
+	return page_size - ((uintptr_t)ptr & (page_size - 1));
+}
+
+static void guard_free(void *ptr, void *pSite)
+{
+	pthread_mutex_lock(&guard_lock);
+
+	int index = guard_slot_index(ptr);
+	guard_slot_t *pSlot = index < 0 ? NULL : &guard_slots[index];
+
+	// Not the start of a block in use: the heap would be corrupted by anything else than stopping here
+	if (!pSlot || pSlot->ptr != ptr || pSlot->pFreeSite) {
+		const char *what = pSlot && pSlot->ptr == ptr ? "double free" : "invalid free";
+		fprintf(stderr, "*** dalloc: %s of %p, called from %p\n", what, ptr, pSite);
+		if (pSlot && pSlot->ptr)
+			fprintf(stderr, "    slot block: %zu bytes at %p, allocated from %p, freed from %p\n",
+				pSlot->size, (void *)pSlot->ptr, pSlot->pAllocSite, pSlot->pFreeSite);
+		abort();
+	}
+
+	// Drop the page (it reads as zeros when the slot is reused) and protect it
+	char *pPage = guard_slot_page(index);
+	madvise(pPage, page_size, MADV_DONTNEED);
+	mprotect(pPage, page_size, PROT_NONE);
+	STAT_ADD(madvise_calls, 1);
+
+	pSlot->pFreeSite = pSite;
+	guard_queue[(guard_queue_head + guard_queue_count++) % GUARD_SLOTS] = index;
+
+	pthread_mutex_unlock(&guard_lock);
+}
+
+/*
+ * SIGSEGV handler. A fault in the pool is described on stderr; snprintf() is
+ * not strictly async-signal-safe, but the process is about to die anyway and
+ * the fault was in our own pages, not in the C library.
+ */
+static void guard_signal_handler(int sig, siginfo_t *pInfo, void *pContext)
+{
+	char *pAddr = pInfo->si_addr;
+
+	if (guard_owns(pAddr)) {
+		char message[512];
+		int length;
+		int index = guard_slot_index(pAddr);
+		guard_slot_t *pSlot = NULL;
+
+		if (index >= 0) {
+			// The slot page itself is protected: its block was freed
+			pSlot = &guard_slots[index];
+			length = snprintf(message, sizeof(message),
+				"*** dalloc: use after free at %p: byte %td of a %zu-byte block at %p\n",
+				pAddr, pAddr - pSlot->ptr, pSlot->size, (void *)pSlot->ptr);
+		}
+		else {
+			// A guard page: blame the closer of the two blocks around it
+			size_t page = (pAddr - pGuardPool) / page_size;
+			guard_slot_t *pLeft = page > 0 ? &guard_slots[page / 2 - 1] : NULL;
+			guard_slot_t *pRight = page / 2 < GUARD_SLOTS ? &guard_slots[page / 2] : NULL;
+
+			if (pLeft && !pLeft->ptr)
+				pLeft = NULL;
+			if (pRight && !pRight->ptr)
+				pRight = NULL;
+
+			if (pLeft && (!pRight || pAddr - (pLeft->ptr + pLeft->size) <= pRight->ptr - pAddr)) {
+				pSlot = pLeft;
+				length = snprintf(message, sizeof(message),
+					"*** dalloc: buffer overflow at %p: %td bytes after a %zu-byte block at %p\n",
+					pAddr, pAddr - (pSlot->ptr + pSlot->size), pSlot->size, (void *)pSlot->ptr);
+			}
+			else if (pRight) {
+				pSlot = pRight;
+				length = snprintf(message, sizeof(message),
+					"*** dalloc: buffer underflow at %p: %td bytes before a %zu-byte block at %p\n",
+					pAddr, pSlot->ptr - pAddr, pSlot->size, (void *)pSlot->ptr);
+			}
+			else
+				length = snprintf(message, sizeof(message), "*** dalloc: invalid access at %p (guard page)\n", pAddr);
+		}
+
+		if (pSlot) {
+			length += snprintf(message + length, sizeof(message) - length, "    allocated from %p", pSlot->pAllocSite);
+			if (pSlot->pFreeSite)
+				length += snprintf(message + length, sizeof(message) - length, ", freed from %p", pSlot->pFreeSite);
+			length += snprintf(message + length, sizeof(message) - length, "\n");
+		}
+
+		(void)!write(STDERR_FILENO, message, length);
+	}
+
+	// Let the signal do what it would have done without us
+	if (guard_prev_action.sa_flags & SA_SIGINFO)
+		guard_prev_action.sa_sigaction(sig, pInfo, pContext);
+	else if (guard_prev_action.sa_handler != SIG_DFL && guard_prev_action.sa_handler != SIG_IGN)
+		guard_prev_action.sa_handler(sig);
+	else
+		sigaction(SIGSEGV, &guard_prev_action, NULL);	// The access faults again on return, and kills
+}
+
+// ***********************************************************************
+// Per-Thread Cache (tcache)
+// ***********************************************************************
+
+/*
+ * Small blocks freed by a thread are kept in that thread's own bins, one LIFO
+ * list per aligned size. The next dalloc() of the same size pops one without
+ * taking any arena lock. For the arenas, cached blocks are still in use.
+ * Bins hold what dalloc() returns (slab objects or heap payloads), not headers.
+ *
+ * - Refill: an empty bin takes TCACHE_BATCH blocks from the thread's arena under one lock.
+ * - Flush:  a full bin gives half of its blocks back, each to its own arena.
+ * - Exit:   a pthread key destructor gives everything back when the thread ends.
+ */
+#define TCACHE_MAX_SIZE		512							// Largest aligned size that is cached
+#define TCACHE_BINS			(TCACHE_MAX_SIZE / ALIGNMENT)	// One bin per 16 bytes
+#define TCACHE_COUNT		64							// Default limit of blocks per bin
+#define TCACHE_COUNT_MAX	4096
+#define TCACHE_BATCH		16							// Blocks taken from the heap per refill
+
+// Cached blocks are chained through the first word of their payload
+#define TCACHE_NEXT(ptr) (*(void **)(ptr))
+
+typedef struct tcache {
+	void *pBins[TCACHE_BINS];
+	unsigned counts[TCACHE_BINS];
+	int state;				// 0: not set up yet, 1: live, -1: thread is exiting
+} tcache_t;
+
+static DALLOC_TLS tcache_t tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+// Changed by dallopt(DALLOC_OPT_TCACHE_COUNT), 0 turns the cache off
+static unsigned tcache_count = TCACHE_COUNT;
+
+static inline unsigned tcache_bin(size_t aligned_size)
+{
+	return aligned_size / ALIGNMENT - 1;
+}
+
+// Returns 'count' blocks of the bin back to their arenas
+static void tcache_flush(unsigned bin, unsigned count)
+{
+	arena_t *pLocked = NULL;
+
+	while (count-- && tcache.pBins[bin]) {
+		void *ptr = tcache.pBins[bin];
+		tcache.pBins[bin] = TCACHE_NEXT(ptr);
+		tcache.counts[bin]--;
+
+		// Blocks freed by this thread may come from other threads' arenas.
+		// Consecutive blocks of the same arena are returned under one lock.
+		arena_t *pArena = owner_arena(ptr, slab_of(ptr));
+		if (pArena != pLocked) {
+			if (pLocked)
+				pthread_mutex_unlock(&pLocked->lock);
+			arena_lock(pArena);
+			pLocked = pArena;
+		}
+
+		arena_free(pArena, ptr);
+	}
+
+	if (pLocked)
+		pthread_mutex_unlock(&pLocked->lock);
+}
+
+// Key destructor: runs when a thread that used the cache exits
+static void tcache_destroy(void *arg)
+{
+	(void)arg;
+
+	// Frees made by later destructors go straight to the heap
+	tcache.state = -1;
+
+	for (unsigned bin = 0; bin < TCACHE_BINS; ++bin)
+		if (tcache.counts[bin])
+			tcache_flush(bin, tcache.counts[bin]);
+}
+
+static void tcache_create_key(void)
+{
+	pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+// Returns 1 if the calling thread may use its cache
+static inline int tcache_ready(void)
+{
+	if (tcache.state == 1)
+		return 1;
+
+	if (tcache.state < 0 || !tcache_count)
+		return 0;
+
+	// First use in this thread: register it, so the destructor runs at exit
+	pthread_once(&tcache_key_once, tcache_create_key);
+	pthread_setspecific(tcache_key, &tcache);
+	tcache.state = 1;
+
+	return 1;
+}
+
+// Pops a cached block, refilling the bin from the arena when it is empty
+static void *tcache_get(size_t aligned_size)
+{
+	unsigned bin = tcache_bin(aligned_size);
+	void *ptr = tcache.pBins[bin];
+
+	if (!ptr) {
+		unsigned batch = tcache_count < TCACHE_BATCH ? tcache_count : TCACHE_BATCH;
+		arena_t *pArena = thread_arena();
+
+		// Chained in the order they were taken, so consecutive dalloc() calls
+		// still get ascending addresses, as they would from the arena itself
+		void **ppLink = &tcache.pBins[bin];
+
+		arena_lock(pArena);
+		for (unsigned i = 0; i < batch; ++i) {
+			void *pNew = arena_alloc(pArena, aligned_size, NULL);
+			if (!pNew)
+				break;
+
+			*ppLink = pNew;
+			ppLink = &TCACHE_NEXT(pNew);
+			tcache.counts[bin]++;
+		}
+		*ppLink = NULL;
+		pthread_mutex_unlock(&pArena->lock);
+
+		if (!(ptr = tcache.pBins[bin]))
+			return NULL;
+	}
+
+	tcache.pBins[bin] = TCACHE_NEXT(ptr);
+	tcache.counts[bin]--;
+
+	return ptr;
+}
+
+// Keeps the block in the cache, flushing half of the bin when it is full
+static void tcache_put(void *ptr, size_t size)
+{
+	unsigned bin = tcache_bin(size);
+
+	TCACHE_NEXT(ptr) = tcache.pBins[bin];
+	tcache.pBins[bin] = ptr;
+
+	if (++tcache.counts[bin] > tcache_count)
+		tcache_flush(bin, tcache.counts[bin] - tcache_count / 2);
+}
+
+// ***********************************************************************
+// Heap Profiler (Sampled Allocation Sites)
+// ***********************************************************************
+
+/*
+ * With DALLOC_OPT_PROF_INTERVAL = N, about one allocation per N bytes allocated
+ * is recorded with its backtrace, until it is freed. The distance between two
+ * samples is drawn from an exponential distribution of mean N (Poisson
+ * sampling), so every byte has the same chance to be sampled whatever the
+ * allocation pattern, and a large block is almost always sampled.
+ *
+ * The fast path only subtracts the size from a thread-local byte counter. A
+ * sampled block is always a heap block (never a slab object, too big for the
+ * thread cache) with is_sampled set in its header: dfree() finds it with the
+ * header check it already does, and nothing else pays for the profiler.
+ *
+ * dalloc_prof_dump() writes the live samples, grouped by backtrace, in the
+ * legacy pprof heap format ("heap_v2"): pprof scales them back up from the
+ * sampling interval. With DALLOC_OPT_PROF_SIGNAL, a signal makes a background
+ * thread dump to dalloc.<pid>.<n>.heap.
+ *
+ * The profiler's own records live in mmap()ed memory, never in the heap it
+ * profiles.
+ */
+#define PROF_MAX_DEPTH		32
+#define PROF_SKIP_FRAMES	2		// prof_alloc() and the dalloc function that called it
+#define PROF_BLOCK_BUCKETS	65536	// Hash table of the live sampled blocks
+#define PROF_TRACE_BUCKETS	4096	// Hash table of the distinct backtraces
+#define PROF_META_SIZE		(64 * 1024)
+
+// One distinct backtrace, with the samples taken there
+typedef struct prof_trace {
+	struct prof_trace *pNext;
+	uint64_t hash;
+	size_t live_count, live_bytes;		// Sampled blocks not freed yet
+	size_t total_count, total_bytes;	// All sampled blocks, since the start
+	int depth;
+	void *frames[PROF_MAX_DEPTH];
+} prof_trace_t;
+
+// One live sampled block
+typedef struct prof_block {
+	struct prof_block *pNext;
+	void *ptr;
+	size_t size;		// Requested size
+	prof_trace_t *pTrace;
+} prof_block_t;
+
+static size_t prof_interval;		// 0: off (default), set by dallopt(DALLOC_OPT_PROF_INTERVAL)
+static DALLOC_TLS int64_t prof_bytes_left;	// Bytes to allocate before the thread's next sample
+static DALLOC_TLS uint64_t prof_seed;		// Random state of the thread, 0 until its first sample
+static DALLOC_TLS int prof_busy;			// Inside the profiler: allocations made by backtrace() are not sampled
+
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static prof_block_t **ppProfBlocks;		// PROF_BLOCK_BUCKETS lists, NULL until the first sample
+static prof_trace_t **ppProfTraces;		// PROF_TRACE_BUCKETS lists
+static size_t prof_trace_count;			// Records in ppProfTraces
+static prof_block_t *pProfFreeBlocks;	// Records of freed blocks, for reuse
+static char *pProfMeta, *pProfMetaEnd;	// Bump allocator for the records
+
+static sem_t prof_dump_sem;
+static int prof_signal;				// Set by DALLOC_OPT_PROF_SIGNAL (0: none), its handler posts prof_dump_sem
+static int prof_dumper_started;
+static unsigned prof_dump_seq;
+
+static int prof_dumper_start(void);
+
+// -ln(u) for u = x / 2^53, x in [1, 2^53]: an exponentially distributed value of mean 1
+// (computed here, the library has no libm dependency)
+static double prof_neg_log(uint64_t x)
+{
+	int e = 63 - __builtin_clzll(x);	// x = m * 2^e, m in [1, 2)
+	double m = (double)x / (double)((uint64_t)1 << e);
+
+	// ln(m) = 2 * atanh(t), t = (m - 1) / (m + 1) is at most 1/3: the series converges fast
+	double t = (m - 1) / (m + 1), t2 = t * t;
+	double ln_m = 2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7 + t2 / 9))));
+
+	return (53 - e) * 0.69314718055994531 - ln_m;
+}
+
+// Bytes until the thread's next sample
+static int64_t prof_next_interval(void)
+{
+	// xorshift64*
+	prof_seed ^= prof_seed >> 12;
+	prof_seed ^= prof_seed << 25;
+	prof_seed ^= prof_seed >> 27;
+	uint64_t x = ((prof_seed * 0x2545F4914F6CDD1DULL) >> 11) + 1;
+
+	return (int64_t)(prof_neg_log(x) * prof_interval) + 1;
+}
+
+// Memory for the profiler's records. The caller must hold prof_lock
+static void *prof_meta_alloc(size_t size)
+{
+	size = ALIGN(size);
+
+	if ((size_t)(pProfMetaEnd - pProfMeta) < size) {
+		size_t length = size > PROF_META_SIZE ? PAGE_ALIGN(size) : PROF_META_SIZE;
+		char *pMap = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		STAT_ADD(mmap_calls, 1);
+		if (pMap == MAP_FAILED)
+			return NULL;
+
+		pProfMeta = pMap;
+		pProfMetaEnd = pMap + length;
+	}
+
+	void *ptr = pProfMeta;
+	pProfMeta += size;
+
+	return ptr;
+}
+
+static inline size_t prof_block_bucket(void *ptr)
+{
+	return ((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ULL >> (64 - 16);	// 16 = log2(PROF_BLOCK_BUCKETS)
+}
+
+// Record of the backtrace, created on its first sample. The caller must hold prof_lock
+static prof_trace_t *prof_trace_find(void **ppFrames, int depth)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (int i = 0; i < depth; ++i)
+		hash = (hash ^ (uintptr_t)ppFrames[i]) * 1099511628211ULL;
+
+	prof_trace_t **ppBucket = &ppProfTraces[hash % PROF_TRACE_BUCKETS];
+	for (prof_trace_t *pTrace = *ppBucket; pTrace; pTrace = pTrace->pNext)
+		if (pTrace->hash == hash && pTrace->depth == depth
+				&& !memcmp(pTrace->frames, ppFrames, depth * sizeof(void *)))
+			return pTrace;
+
+	prof_trace_t *pTrace = prof_meta_alloc(sizeof(prof_trace_t));
+	if (!pTrace)
+		return NULL;
+
+	*pTrace = (prof_trace_t){ .pNext = *ppBucket, .hash = hash, .depth = depth };
+	memcpy(pTrace->frames, ppFrames, depth * sizeof(void *));
+	*ppBucket = pTrace;
+	++prof_trace_count;
+
+	return pTrace;
+}
+
+/*
+ * Slow path of a sampled allocation: a heap block of its own, recorded with its backtrace.
+ * Returns NULL when the allocation is not sampled after all (first call of the thread, or
+ * inside the profiler): the caller then allocates normally.
+ */
+static __attribute__((noinline)) void *prof_alloc(size_t size, int zero)
+{
+	if (!prof_seed) {
+		// First time for this thread: start counting from a random point
+		prof_seed = ((uintptr_t)&prof_seed ^ now_ns()) | 1;
+		prof_bytes_left = prof_next_interval();
+		return NULL;
+	}
+
+	prof_bytes_left = prof_next_interval();
+
+	if (prof_busy || size > SIZE_MAX / 2)
+		return NULL;
+
+	// Keep it out of the slabs and of the thread cache, so that it always has a header
+	size_t aligned_size = ALIGN(size);
+	if (aligned_size <= TCACHE_MAX_SIZE)
+		aligned_size = TCACHE_MAX_SIZE + ALIGNMENT;
+
+	header_t *pHeader;
+	int fresh = 0;
+
+	if (aligned_size >= mmap_threshold) {
+		pHeader = mmap_alloc(aligned_size, ALIGNMENT);
+		fresh = 1;
+	}
+	else {
+		arena_t *pArena = thread_arena();
+
+		arena_lock(pArena);
+		pHeader = heap_alloc(pArena, aligned_size, &fresh);
+		pthread_mutex_unlock(&pArena->lock);
+	}
+
+	if (!pHeader)
+		return NULL;
+
+	void *ptr = pHeader + 1;
+	if (zero && !pHeader->data.is_mmapped)
+		memset(ptr, 0, fresh ? (size < FREE_DIRTY_SIZE ? size : FREE_DIRTY_SIZE) : size);
+
+	// backtrace() may allocate (the first time, to load the unwinder): not sampled
+	void *frames[PROF_MAX_DEPTH + PROF_SKIP_FRAMES];
+	prof_busy = 1;
+	int depth = backtrace(frames, PROF_MAX_DEPTH + PROF_SKIP_FRAMES) - PROF_SKIP_FRAMES;
+	prof_busy = 0;
+	if (depth < 0)
+		depth = 0;
+
+	pthread_mutex_lock(&prof_lock);
+
+	if (!ppProfBlocks) {
+		ppProfBlocks = prof_meta_alloc(PROF_BLOCK_BUCKETS * sizeof(prof_block_t *));
+		ppProfTraces = prof_meta_alloc(PROF_TRACE_BUCKETS * sizeof(prof_trace_t *));
+	}
+
+	prof_trace_t *pTrace = ppProfBlocks && ppProfTraces ? prof_trace_find(frames + PROF_SKIP_FRAMES, depth) : NULL;
+	prof_block_t *pBlock = pProfFreeBlocks;
+
+	if (pBlock)
+		pProfFreeBlocks = pBlock->pNext;
+	else if (pTrace)
+		pBlock = prof_meta_alloc(sizeof(prof_block_t));
+
+	// Out of memory for the records: the block is simply not profiled
+	if (pTrace && pBlock) {
+		size_t bucket = prof_block_bucket(ptr);
+		*pBlock = (prof_block_t){ .pNext = ppProfBlocks[bucket], .ptr = ptr, .size = size, .pTrace = pTrace };
+		ppProfBlocks[bucket] = pBlock;
+
+		pTrace->live_count++;
+		pTrace->live_bytes += size;
+		pTrace->total_count++;
+		pTrace->total_bytes += size;
+		pHeader->data.is_sampled = 1;
+	}
+	else if (pBlock) {
+		pBlock->pNext = pProfFreeBlocks;
+		pProfFreeBlocks = pBlock;
+	}
+
+	pthread_mutex_unlock(&prof_lock);
+
+	// A forked child inherits the signal handler but not the dumper thread: start it with the first sample
+	if (prof_signal && !prof_dumper_started) {
+		prof_busy = 1;
+		prof_dumper_start();
+		prof_busy = 0;
+	}
+
+	return ptr;
+}
+
+// Forgets a sampled block that is being freed
+static void prof_free(void *ptr)
+{
+	pthread_mutex_lock(&prof_lock);
+
+	for (prof_block_t **ppLink = &ppProfBlocks[prof_block_bucket(ptr)]; *ppLink; ppLink = &(*ppLink)->pNext) {
+		prof_block_t *pBlock = *ppLink;
+
+		if (pBlock->ptr == ptr) {
+			pBlock->pTrace->live_count--;
+			pBlock->pTrace->live_bytes -= pBlock->size;
+
+			*ppLink = pBlock->pNext;
+			pBlock->pNext = pProfFreeBlocks;
+			pProfFreeBlocks = pBlock;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&prof_lock);
+}
+
+// Small buffered writer on a file descriptor: the dump must not allocate from the heap it describes
+typedef struct prof_writer {
+	int fd;
+	int failed;
+	size_t length;
+	char buffer[4096];
+} prof_writer_t;
+
+static void prof_flush(prof_writer_t *pWriter)
+{
+	if (pWriter->length && write(pWriter->fd, pWriter->buffer, pWriter->length) != (ssize_t)pWriter->length)
+		pWriter->failed = 1;
+
+	pWriter->length = 0;
+}
+
+static void __attribute__((format(printf, 2, 3))) prof_printf(prof_writer_t *pWriter, const char *format, ...)
+{
+	va_list args;
+
+	if (sizeof(pWriter->buffer) - pWriter->length < 512)
+		prof_flush(pWriter);
+
+	va_start(args, format);
+	int n = vsnprintf(pWriter->buffer + pWriter->length, sizeof(pWriter->buffer) - pWriter->length, format, args);
+	va_end(args);
+
+	if (n > 0)
+		pWriter->length += (size_t)n < sizeof(pWriter->buffer) - pWriter->length ? (size_t)n : 0;
+}
+
+int dalloc_prof_dump(const char *path)
+{
+	dalloc_init();
+
+	prof_writer_t writer = { .fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) };
+	size_t live_count = 0, live_bytes = 0, total_count = 0, total_bytes = 0;
+
+	if (writer.fd < 0)
+		return -1;
+
+	// Allocations of the C library while dumping (e.g. by snprintf) are not sampled
+	prof_busy = 1;
+
+	// Copy of the records, taken under the lock: the writes below must not stall every sampled allocation.
+	// The copy is mapped outside the lock, again if new backtraces showed up in between.
+	prof_trace_t *pCopy = NULL;
+	size_t capacity = 0, count = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&prof_lock);
+		if (prof_trace_count <= capacity)
+			break;
+
+		size_t needed = prof_trace_count + 64;
+		pthread_mutex_unlock(&prof_lock);
+
+		if (pCopy) {
+			munmap(pCopy, PAGE_ALIGN(capacity * sizeof(prof_trace_t)));
+			STAT_ADD(munmap_calls, 1);
+		}
+		pCopy = mmap(NULL, PAGE_ALIGN(needed * sizeof(prof_trace_t)), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		STAT_ADD(mmap_calls, 1);
+		if (pCopy == MAP_FAILED) {
+			prof_busy = 0;
+			close(writer.fd);
+			return -1;
+		}
+		capacity = needed;
+	}
+
+	for (size_t i = 0; ppProfTraces && i < PROF_TRACE_BUCKETS; ++i)
+		for (prof_trace_t *pTrace = ppProfTraces[i]; pTrace; pTrace = pTrace->pNext)
+			pCopy[count++] = *pTrace;
+
+	pthread_mutex_unlock(&prof_lock);
+
+	for (size_t i = 0; i < count; ++i) {
+		live_count += pCopy[i].live_count;
+		live_bytes += pCopy[i].live_bytes;
+		total_count += pCopy[i].total_count;
+		total_bytes += pCopy[i].total_bytes;
+	}
+
+	// Header: totals, and the sampling interval pprof scales the samples up with
+	prof_printf(&writer, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+		live_count, live_bytes, total_count, total_bytes, prof_interval);
+
+	for (size_t i = 0; i < count; ++i) {
+		prof_printf(&writer, "%zu: %zu [%zu: %zu] @", pCopy[i].live_count, pCopy[i].live_bytes,
+			pCopy[i].total_count, pCopy[i].total_bytes);
+		for (int f = 0; f < pCopy[i].depth; ++f)
+			prof_printf(&writer, " %p", pCopy[i].frames[f]);
+		prof_printf(&writer, "\n");
+	}
+
+	if (pCopy) {
+		munmap(pCopy, PAGE_ALIGN(capacity * sizeof(prof_trace_t)));
+		STAT_ADD(munmap_calls, 1);
+	}
+
+	// pprof finds the symbols with the address map of the process
+	prof_printf(&writer, "\nMAPPED_LIBRARIES:\n");
+	prof_flush(&writer);
+
+	int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+	if (maps >= 0) {
+		ssize_t n;
+		while ((n = read(maps, writer.buffer, sizeof(writer.buffer))) > 0) {
+			writer.length = n;
+			prof_flush(&writer);
+		}
+		close(maps);
+	}
+
+	prof_busy = 0;
+
+	if (close(writer.fd) != 0)
+		writer.failed = 1;
+
+	return writer.failed ? -1 : 0;
+}
+
+// Background thread: dumps a profile each time the profile signal arrives
+static void *prof_dumper_routine(void *arg)
+{
+	(void)arg;
+
+	for (;;) {
+		if (sem_wait(&prof_dump_sem) != 0)
+			continue;
+
+		char path[64];
+		snprintf(path, sizeof(path), "dalloc.%d.%u.heap", (int)getpid(), prof_dump_seq++);
+		if (dalloc_prof_dump(path) != 0)
+			fprintf(stderr, "dalloc: could not write the heap profile %s\n", path);
+	}
+
+	return NULL;
+}
+
+// Only wakes the dumper up: sem_post() is async-signal-safe, the dump is not
+static void prof_signal_handler(int sig)
+{
+	(void)sig;
+	sem_post(&prof_dump_sem);
+}
+
+// Starts the dumper thread once (again in a forked child). Returns 1 if it runs.
+// pthread_create() allocates: the flag is set before, so those allocations do not come back here
+static int prof_dumper_start(void)
+{
+	pthread_mutex_lock(&prof_lock);
+	int start = !prof_dumper_started;
+	prof_dumper_started = 1;
+	pthread_mutex_unlock(&prof_lock);
+
+	if (!start)
+		return 1;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, prof_dumper_routine, NULL) != 0) {
+		prof_dumper_started = 0;
+		return 0;
+	}
+
+	pthread_detach(thread);
+	return 1;
+}
+
+// Makes 'sig' trigger a dump. Returns 1 on success
+static int prof_signal_set(int sig)
+{
+	pthread_mutex_lock(&prof_lock);
+
+	// Only the first time: later, the dumper may be waiting on it
+	if (!prof_signal)
+		sem_init(&prof_dump_sem, 0, 0);
+	prof_signal = sig;
+
+	pthread_mutex_unlock(&prof_lock);
+
+	if (!prof_dumper_start())
+		return 0;
+
+	struct sigaction action = { 0 };
+	action.sa_handler = prof_signal_handler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+
+	return sigaction(sig, &action, NULL) == 0;
+}
+
+// ***********************************************************************
+// Allocation Tracing (Record & Replay)
+// ***********************************************************************
+
+/*
+ * dalloc_trace_start() records every call the program makes: the operation,
+ * the size, the block's address (the object's id), the thread and the time.
+ * dalloc_replay plays the file back, against dalloc or the system malloc, so an
+ * allocator change can be measured on the real allocation pattern of a program
+ * instead of a synthetic benchmark.
+ *
+ * Each thread appends to a buffer of its own, with no lock: a full buffer is
+ * written to the file by its thread with one write() (O_APPEND, so threads do
+ * not overwrite each other). The file is read back sorted by time, which is why
+ * a free is recorded before the block is released and an allocation after it
+ * is made: when an address is reused, the free always comes first.
+ *
+ * The calls dalloc makes to itself (drealloc moving a block, dvalloc...) are
+ * not recorded: only the outermost call of the thread is. The recorder's own
+ * memory comes from mmap(), never from the heap it records.
+ */
+#define TRACE_BUFFER_RECORDS	8192	// 256 KiB per thread
+
+typedef struct trace_buffer {
+	struct trace_buffer *pNext;		// All buffers, so dalloc_trace_stop() can write them out
+	int busy;						// The owner thread is adding a record
+	int owned;						// 0: its thread exited, the buffer can be given to a new one
+	unsigned thread;
+	unsigned count;
+	dalloc_trace_record_t records[TRACE_BUFFER_RECORDS];
+} trace_buffer_t;
+
+static int trace_on;				// Set by dalloc_trace_start(), read by every public call
+static int trace_fd = -1;
+static uint64_t trace_start_ns;
+static unsigned trace_threads;		// Numbers given to threads so far
+
+static DALLOC_TLS trace_buffer_t *pTraceBuffer;
+static DALLOC_TLS int trace_busy;	// Inside a recorded call: the calls it makes are not recorded
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer_t *pTraceBuffers;
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+static void *aligned_alloc_impl(size_t alignment, size_t size);
+
+// Writes the buffered records to the file. Called by the owner while busy, or once it is not
+static void trace_flush(trace_buffer_t *pBuffer)
+{
+	char *pData = (char *)pBuffer->records;
+	size_t left = pBuffer->count * sizeof(dalloc_trace_record_t);
+
+	while (left) {
+		ssize_t written = write(trace_fd, pData, left);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			break;
+
+		pData += written;
+		left -= written;
+	}
+
+	pBuffer->count = 0;
+}
+
+// Key destructor: writes out the records of an exiting thread and frees its buffer for another
+static void trace_destroy(void *arg)
+{
+	trace_buffer_t *pBuffer = arg;
+
+	__atomic_store_n(&pBuffer->busy, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&trace_on, __ATOMIC_SEQ_CST) && pBuffer->count)
+		trace_flush(pBuffer);
+	__atomic_store_n(&pBuffer->busy, 0, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&trace_lock);
+	pBuffer->owned = 0;
+	pthread_mutex_unlock(&trace_lock);
+
+	pTraceBuffer = NULL;
+}
+
+static void trace_create_key(void)
+{
+	pthread_key_create(&trace_key, trace_destroy);
+}
+
+// Gives the calling thread a buffer (and a number) on its first recorded call
+static trace_buffer_t *trace_buffer_new(void)
+{
+	trace_buffer_t *pBuffer;
+
+	pthread_once(&trace_key_once, trace_create_key);
+	pthread_mutex_lock(&trace_lock);
+
+	for (pBuffer = pTraceBuffers; pBuffer && pBuffer->owned; pBuffer = pBuffer->pNext)
+		;
+
+	if (!pBuffer) {
+		pBuffer = mmap(NULL, sizeof(trace_buffer_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (pBuffer == MAP_FAILED) {
+			pthread_mutex_unlock(&trace_lock);
+			return NULL;
+		}
+
+		pBuffer->pNext = pTraceBuffers;
+		pTraceBuffers = pBuffer;
+	}
+
+	pBuffer->owned = 1;
+	pBuffer->thread = ++trace_threads;
+
+	pthread_mutex_unlock(&trace_lock);
+
+	pthread_setspecific(trace_key, pBuffer);
+	return pTraceBuffer = pBuffer;
+}
+
+static void trace_record(unsigned op, void *ptr, size_t size, size_t arg)
+{
+	trace_buffer_t *pBuffer = pTraceBuffer;
+
+	if (!pBuffer && !(pBuffer = trace_buffer_new()))
+		return;
+
+	// dalloc_trace_stop() turns tracing off, then waits for the flag to drop before it
+	// writes the buffer: one of the two always sees what the other did (both are seq_cst)
+	__atomic_store_n(&pBuffer->busy, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&trace_on, __ATOMIC_SEQ_CST)) {
+		dalloc_trace_record_t *pRecord = &pBuffer->records[pBuffer->count++];
+
+		pRecord->time_ns = now_ns() - trace_start_ns;
+		pRecord->thread = pBuffer->thread;
+		pRecord->size = size;
+		pRecord->op = op;
+		pRecord->id = (uintptr_t)ptr;
+		pRecord->arg = arg;
+
+		if (pBuffer->count == TRACE_BUFFER_RECORDS)
+			trace_flush(pBuffer);
+	}
+
+	__atomic_store_n(&pBuffer->busy, 0, __ATOMIC_RELEASE);
+}
+
+// Makes a recorded allocation call: 'arg' is the count for DALLOC_TRACE_CALLOC,
+// the alignment for DALLOC_TRACE_ALIGNED. Kept out of line, the public calls only test trace_on
+static __attribute__((noinline)) void *trace_alloc(unsigned op, void *pOld, size_t size, size_t arg)
+{
+	void *ptr;
+
+	// Recorded before the old block may be freed (and its address taken by another thread)
+	if (op == DALLOC_TRACE_REALLOC)
+		trace_record(op, pOld, size, 0);
+
+	trace_busy = 1;
+
+	switch (op) {
+	case DALLOC_TRACE_CALLOC:
+		ptr = dcalloc(arg, size);
+		size *= arg;
+		break;
+	case DALLOC_TRACE_ALIGNED:
+		ptr = aligned_alloc_impl(arg, size);
+		break;
+	case DALLOC_TRACE_REALLOC:
+		ptr = drealloc(pOld, size);
+		op = DALLOC_TRACE_REALLOC_END;
+		arg = 0;
+		break;
+	default:
+		ptr = dalloc(size);
+		break;
+	}
+
+	trace_busy = 0;
+
+	// A failed allocation changed nothing, a failed drealloc is needed to pair its start
+	if (ptr || op == DALLOC_TRACE_REALLOC_END)
+		trace_record(op, ptr, size, arg);
+
+	return ptr;
+}
+
+// Makes a recorded dalloc_batch() call: one record per block
+static __attribute__((noinline)) size_t trace_batch(size_t size, size_t count, void **ppOut)
+{
+	trace_busy = 1;
+	size_t done = dalloc_batch(size, count, ppOut);
+	trace_busy = 0;
+
+	for (size_t i = 0; i < done; ++i)
+		trace_record(DALLOC_TRACE_ALLOC, ppOut[i], size, 0);
+
+	return done;
+}
+
+int dalloc_trace_start(const char *path)
+{
+	dalloc_init();
+
+	static int exit_registered;
+	dalloc_trace_header_t header = { DALLOC_TRACE_MAGIC, DALLOC_TRACE_VERSION, sizeof(dalloc_trace_record_t) };
+
+	pthread_mutex_lock(&trace_lock);
+
+	if (trace_fd >= 0) {
+		pthread_mutex_unlock(&trace_lock);
+		errno = EBUSY;
+		return -1;
+	}
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0 || write(fd, &header, sizeof(header)) != sizeof(header)) {
+		if (fd >= 0)
+			close(fd);
+		pthread_mutex_unlock(&trace_lock);
+		return -1;
+	}
+
+	// Records still buffered at exit are written by dalloc_trace_stop()
+	if (!exit_registered)
+		exit_registered = atexit(dalloc_trace_stop) == 0;
+
+	trace_fd = fd;
+	trace_start_ns = now_ns();
+	__atomic_store_n(&trace_on, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_unlock(&trace_lock);
+	return 0;
+}
+
+void dalloc_trace_stop(void)
+{
+	pthread_mutex_lock(&trace_lock);
+
+	if (trace_fd < 0) {
+		pthread_mutex_unlock(&trace_lock);
+		return;
+	}
+
+	__atomic_store_n(&trace_on, 0, __ATOMIC_SEQ_CST);
+
+	// A thread in the middle of a record finishes it (and may write its own buffer) first
+	for (trace_buffer_t *pBuffer = pTraceBuffers; pBuffer; pBuffer = pBuffer->pNext) {
+		while (__atomic_load_n(&pBuffer->busy, __ATOMIC_SEQ_CST))
+			sched_yield();
+
+		trace_flush(pBuffer);
+	}
+
+	close(trace_fd);
+	trace_fd = -1;
+
+	pthread_mutex_unlock(&trace_lock);
+}
+
+// ***********************************************************************
+// Public API
+// ***********************************************************************
+
+void *dalloc(size_t size)
+{
+	dalloc_init();
+
+	header_t *pHeader;
+	void *ptr;
+
+	if (trace_on && !trace_busy)
+		return trace_alloc(DALLOC_TRACE_ALLOC, NULL, size, 0);
+
+	// Sizes close to SIZE_MAX would wrap around to 0 after ALIGN()
+	if (size == 0 || size > SIZE_MAX / 2)
+		return NULL;
+
+	// Sampled request: a guarded page of its own
+	if (guard_rate && guard_tick() && (ptr = guard_alloc(size, ALIGNMENT, __builtin_return_address(0))))
+		return ptr;
+
+	// Profiled request: every prof_interval bytes on average, recorded with its backtrace
+	if (prof_interval && (prof_bytes_left -= (int64_t)size) < 0 && (ptr = prof_alloc(size, 0)))
+		return ptr;
+
+	// Align the user's memory request
+	size_t aligned_size = ALIGN(size);
+
+	// Small request: try the thread's own cache first, no lock needed
+	if (aligned_size <= TCACHE_MAX_SIZE && tcache_ready())
+		if ((ptr = tcache_get(aligned_size)))
+			return ptr;
+
+	// Large request: give it its own mapping
+	if (aligned_size >= mmap_threshold) {
+		if (!(pHeader = mmap_alloc(aligned_size, ALIGNMENT)))
+			return NULL;
+
+		return (void*)(pHeader + 1);
+	}
+
+	arena_t *pArena = thread_arena();
+
+	arena_lock(pArena); // Lock
+	ptr = arena_alloc(pArena, aligned_size, NULL);
+	pthread_mutex_unlock(&pArena->lock);
+
+	return ptr;
+}
+
+// *** dcalloc (Clear Allocation)
+void *dcalloc(size_t n, size_t size)
+{
+	dalloc_init();
+
+	if (trace_on && !trace_busy)
+		return trace_alloc(DALLOC_TRACE_CALLOC, NULL, size, n);
+
+	// Overflow Check ***************************************************************
+	/* 	
+	  It's too late to check after performing multiplication (because it 
+	  will already be overflowing). Therefore, we will perform the check 
+	  by reversing it with division.
+	*/
+	// In Math: 		If (num * size) > SIZE_MAX, there is an overflow. 
+	// Computer Logic: 	If (num > SIZE_MAX / size), there is an overflow. 
+	// 'size == 0' check is to prevent the "Division by Zero" error.
+	if (size != 0 && n > SIZE_MAX / size) {
+		// Overflow! Incorrect memory allocation will occur if the operation is performed. 
+		// Returning a NULL error with an ENOMEM (Not enough memory)
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// Calculate total size (It's safe now)
+	size_t total = n * size;
+
+	// Same size checks as dalloc()
+	if (total == 0 || total > SIZE_MAX / 2)
+		return NULL;
+
+	size_t aligned_size = ALIGN(total);
+	void *ptr;
+	int fresh = 0;
+
+	// Sampled request: guarded pages are zero already
+	if (guard_rate && guard_tick() && (ptr = guard_alloc(total, ALIGNMENT, __builtin_return_address(0))))
+		return ptr;
+
+	if (prof_interval && (prof_bytes_left -= (int64_t)total) < 0 && (ptr = prof_alloc(total, 1)))
+		return ptr;
+
+	// Small request: the cache holds memory that was used before, clear all of it
+	if (aligned_size <= TCACHE_MAX_SIZE && tcache_ready() && (ptr = tcache_get(aligned_size))) {
+		memset(ptr, 0, total);
+		return ptr;
+	}
+
+	// Large request: a fresh mapping is already zero-filled by the kernel,
+	// touching it would only fault every page in
+	if (aligned_size >= mmap_threshold) {
+		header_t *pHeader = mmap_alloc(aligned_size, ALIGNMENT);
+		return pHeader ? (void *)(pHeader + 1) : NULL;
+	}
+
+	arena_t *pArena = thread_arena();
+
+	arena_lock(pArena);
+	ptr = arena_alloc(pArena, aligned_size, &fresh);
+	pthread_mutex_unlock(&pArena->lock);
+
+	if (!ptr)
+		return NULL;
+
+	// Memory nobody used since the OS gave it (e.g. just committed) is zero,
+	// except the free-list links the index wrote at its start
+	if (fresh)
+		memset(ptr, 0, total < FREE_DIRTY_SIZE ? total : FREE_DIRTY_SIZE);
+	else
+		memset(ptr, 0, total);
+	
+	return ptr;
+}
+
+void *drealloc(void *ptr, size_t size)
+{
+	dalloc_init();
+
+	if (trace_on && !trace_busy)
+		return trace_alloc(DALLOC_TRACE_REALLOC, ptr, size, 0);
+
+	// if ptr is NULL, behave like malloc
+	if (!ptr)
+		return dalloc(size);
+
+	// if size is 0, behave like free
+	if (size == 0) {
+		dfree(ptr);
+		return NULL;
+	}
+
+	// Sizes close to SIZE_MAX would wrap around to 0 after ALIGN()
+	if (size > SIZE_MAX / 2)
+		return NULL;
+
+	// Guarded block: always moves, its slot is protected once it is freed
+	if (guard_owns(ptr)) {
+		void *pNewBlock = dalloc(size);
+		if (pNewBlock) {
+			size_t old_size = guard_usable_size(ptr);
+			memcpy(pNewBlock, ptr, old_size < size ? old_size : size);
+			guard_free(ptr, __builtin_return_address(0));
+		}
+
+		return pNewBlock;
+	}
+
+	size_t aligned_size = ALIGN(size);
+
+	// Slab object: it can only stay in its slot if the new size fits its class
+	slab_t *pSlab = slab_of(ptr);
+	if (pSlab) {
+		if (pSlab->size >= aligned_size)
+			return ptr;
+
+		void *pNewBlock = dalloc(size);
+		if (pNewBlock) {
+			memcpy(pNewBlock, ptr, pSlab->size);
+			dfree(ptr);
+		}
+
+		return pNewBlock;
+	}
+
+	// Get the current header
+	header_t *pHeader = (header_t *)ptr - 1;
+
+	// Profiled block: moved, so that the profiler sees a free and a new (maybe sampled) allocation
+	if (pHeader->data.is_sampled) {
+		void *pNewBlock = dalloc(size);
+		if (pNewBlock) {
+			memcpy(pNewBlock, ptr, pHeader->data.size < size ? pHeader->data.size : size);
+			dfree(ptr);
+		}
+
+		return pNewBlock;
+	}
+
+	// Mapped block: it has no neighbours to split or merge with
+	if (pHeader->data.is_mmapped) {
+		// Still fits in the mapping: the pages it no longer needs go back to the kernel
+		if (pHeader->data.size >= aligned_size) {
+			mmap_shrink(pHeader, aligned_size);
+			return ptr;
+		}
+
+#ifdef MREMAP_MAYMOVE
+		// Let the kernel grow (or move) the mapping, nothing is copied
+		if ((pHeader = mmap_resize(pHeader, aligned_size)))
+			return pHeader + 1;
+
+		pHeader = (header_t *)ptr - 1;
+#endif
+
+		void *pNewBlock = dalloc(size);
+		if (pNewBlock) {
+			memcpy(pNewBlock, ptr, pHeader->data.size);
+			dfree(ptr);
+		}
+
+		return pNewBlock;
+	}
+
+	arena_t *pArena = block_arena(pHeader);
+
+	arena_lock(pArena);
+
+	// Scenario A: Shrinking ************************************************
+	if (pHeader->data.size >= aligned_size + sizeof(header_t) + ALIGNMENT) {
+		// The split_block function divides the block and attaches the remaining part to the header->next
+		split_block(pArena, pHeader, aligned_size);
+
+		// Now try merging that newly formed remainder with its neighbor on the right.
+        header_t *pRemainder = next_block(pHeader);       // Newly formed free space
+        header_t *pNeighbor = next_block(pRemainder);     // The neighbor to its right (maybe the fence)
+
+        // Is the neighbor's space free?
+        if (pNeighbor->data.is_free)
+			// Merge remainder and neighbor
+			merge_next(pArena, pRemainder);
+
+		pthread_mutex_unlock(&pArena->lock);
+        return ptr;
+	}
+
+	// Still fits, but the slack is too small to be split off as a new block.
+	// Falling through to relocation would copy the old (larger) size into a smaller block.
+	if (pHeader->data.size >= aligned_size) {
+		pthread_mutex_unlock(&pArena->lock);
+		return ptr;
+	}
+
+	// Scenario B: Expansion ************************************************
+	// If it hasn't shrunk, maybe we can expand it in place?
+	// Current size + header + adjacent size >= Requested size?
+	header_t *pNext = next_block(pHeader);
+
+	if (pNext->data.is_free &&
+		pHeader->data.size + sizeof(header_t) + pNext->data.size >= aligned_size) {
+		merge_next(pArena, pHeader);
+		// The neighbour may be much bigger (e.g. the free end of the heap): keep only what is needed
+		split_block(pArena, pHeader, aligned_size);
+		pthread_mutex_unlock(&pArena->lock);
+		return ptr;
+	}
+
+	// Scenario B2: Tail growth *********************************************
+	// The block (maybe followed by a free one) is the last of the arena's newest chunk:
+	// commit more of its segment. If the segment has room left, the new pages continue
+	// the chunk and the block grows into them, nothing is copied.
+	header_t *pLast = pNext->data.is_free ? pNext : pHeader;
+
+	if (next_block(pLast) == pArena->pTop) {
+		size_t have = pHeader->data.size + (pLast != pHeader ? sizeof(header_t) + pNext->data.size : 0);
+
+		arena_grow(pArena, aligned_size - have);
+
+		pNext = next_block(pHeader);
+		if (pNext->data.is_free &&
+			pHeader->data.size + sizeof(header_t) + pNext->data.size >= aligned_size) {
+			merge_next(pArena, pHeader);
+			// Give back what the growth step added beyond the request
+			split_block(pArena, pHeader, aligned_size);
+			pthread_mutex_unlock(&pArena->lock);
+			return ptr;
+		}
+		// Otherwise the memory came from a new segment (a new chunk): it stays free for the relocation below
+	}
+
+	size_t old_size = pHeader->data.size;
+	pthread_mutex_unlock(&pArena->lock);
+
+	// Scenario C: Relocation ***********************************************
+	// No free space to expand, so we'll have to reallocate it
+	// The lock is released first: the new block may come from another arena, and
+	// holding two arena locks at once could deadlock with a thread doing the opposite.
+	void *pNewBlock = dalloc(size);
+
+	if (pNewBlock) {
+		memcpy(pNewBlock, ptr, old_size);
+		dfree(ptr);
+	}
+
+	return pNewBlock;
+}
+
+void dfree(void *pBlock)
+{
+	dalloc_init();
+
+	if (!pBlock)
+		return;
+
+	// Recorded while the address still belongs to the block
+	if (trace_on && !trace_busy)
+		trace_record(DALLOC_TRACE_FREE, pBlock, 0, 0);
+
+	if (guard_owns(pBlock)) {
+		guard_free(pBlock, __builtin_return_address(0));
+		return;
+	}
+
+	// Slab objects have no header, their slab knows the size
+	slab_t *pSlab = slab_of(pBlock);
+
+	if (!pSlab) {
+		// Go back to pHeader using pointer arithmetic
+		// We gave the user (pHeader + 1), now we are returning 1.
+		header_t *pHeader = (header_t *)pBlock - 1;
+
+		// Profiled block: the profiler stops counting it (it is never cached, see prof_alloc)
+		if (pHeader->data.is_sampled)
+			prof_free(pBlock);
+
+		// Large block: hand it straight back to the kernel
+		if (pHeader->data.is_mmapped) {
+			mmap_free(pHeader);
+			return;
+		}
+	}
+
+	// Small block: keep it in the thread's cache for the next dalloc()
+	size_t size = block_size(pBlock, pSlab);
+	if (size <= TCACHE_MAX_SIZE && tcache_ready()) {
+		tcache_put(pBlock, size);
+		return;
+	}
+
+	arena_t *pArena = owner_arena(pBlock, pSlab);
+
+	// Another thread is using the arena: leave the block to it instead of waiting
+	if (pthread_mutex_trylock(&pArena->lock) != 0) {
+		remote_push(pArena, pBlock);
+		return;
+	}
+
+	if (__atomic_load_n(&pArena->pRemoteFrees, __ATOMIC_RELAXED))
+		remote_drain(pArena);
+
+	arena_free(pArena, pBlock);
+	pthread_mutex_unlock(&pArena->lock);
+}
+
+/*
+ * Sized free: the caller tells the size it asked for, so a slab object can go
+ * into its cache bin without reading its slab header, and the object itself is
+ * only written (the cache link). Everything else takes the dfree() path.
+ * Compile with -DDALLOC_DEBUG to check the size against the block.
+ */
+void dfree_sized(void *ptr, size_t size)
+{
+	dalloc_init();
+
+	if (!ptr)
+		return;
+
+#ifdef DALLOC_DEBUG
+	if (size > dalloc_usable_size(ptr)) {
+		fprintf(stderr, "dalloc: dfree_sized(%p, %zu): the block holds only %zu bytes\n",
+			ptr, size, dalloc_usable_size(ptr));
+		abort();
+	}
+#endif
+
+	// The class of a slab object is at least ALIGN(size), so the bin of ALIGN(size) is safe for it
+	// (it is only bigger after an in-place drealloc() shrink)
+	// Traced sized frees take the dfree() path, which records them
+	size_t aligned_size = ALIGN(size);
+	if (size && aligned_size <= TCACHE_MAX_SIZE && !trace_on && slab_of(ptr) && tcache_ready()) {
+		tcache_put(ptr, aligned_size);
+		return;
+	}
+
+	dfree(ptr);
+}
+
+// ***********************************************************************
+// Batch Allocation
+// ***********************************************************************
+
+/*
+ * Many objects of one size, allocated or freed together (e.g. the nodes of a
+ * parse tree): one lock round-trip for the whole batch instead of one per object.
+ * Heap-sized objects are cut from shared regions (heap_alloc_batch), small ones
+ * come straight from the slabs. The thread cache is bypassed in both directions:
+ * a batch would only flood it.
+ */
+size_t dalloc_batch(size_t size, size_t count, void **ppOut)
+{
+	dalloc_init();
+
+	size_t done = 0, sampled = 0;
+
+	if (trace_on && !trace_busy)
+		return trace_batch(size, count, ppOut);
+
+	if (size == 0 || size > SIZE_MAX / 2 || !count)
+		return 0;
+
+	// Each element is a request for the samplers, as if dalloc() was called 'count' times.
+	// Sampled blocks are put at the end of ppOut, and moved after the others once they are done.
+	if (guard_rate || prof_interval)
+		for (size_t i = 0; i < count; ++i) {
+			void *ptr = NULL;
+
+			if (guard_rate && guard_tick())
+				ptr = guard_alloc(size, ALIGNMENT, __builtin_return_address(0));
+			if (!ptr && prof_interval && (prof_bytes_left -= (int64_t)size) < 0)
+				ptr = prof_alloc(size, 0);
+
+			if (ptr)
+				ppOut[count - ++sampled] = ptr;
+		}
+
+	count -= sampled;
+
+	size_t aligned_size = ALIGN(size);
+
+	// Large objects have a mapping each, there is nothing to share
+	if (aligned_size >= mmap_threshold) {
+		for (; done < count; ++done) {
+			header_t *pHeader = mmap_alloc(aligned_size, ALIGNMENT);
+			if (!pHeader)
+				break;
+
+			ppOut[done] = pHeader + 1;
+		}
+	} else if (count) {
+		arena_t *pArena = thread_arena();
+
+		arena_lock(pArena);
+
+		if (aligned_size <= SLAB_MAX_SIZE && slab_enabled)
+			for (; done < count; ++done)
+				if (!(ppOut[done] = slab_alloc(pArena, aligned_size)))
+					break;
+
+		// The heap serves everything the slabs did not
+		if (done < count)
+			done += heap_alloc_batch(pArena, aligned_size, count - done, ppOut + done);
+
+		pthread_mutex_unlock(&pArena->lock);
+	}
+
+	// Out of memory: no gap between the blocks returned
+	if (sampled && done < count)
+		memmove(ppOut + done, ppOut + count, sampled * sizeof(void *));
+
+	return done + sampled;
+}
+
+void dfree_batch(void **ppPtrs, size_t count)
+{
+	dalloc_init();
+
+	arena_t *pLocked = NULL;
+
+	if (trace_on && !trace_busy)
+		for (size_t i = 0; i < count; ++i)
+			if (ppPtrs[i])
+				trace_record(DALLOC_TRACE_FREE, ppPtrs[i], 0, 0);
+
+	for (size_t i = 0; i < count; ++i) {
+		void *ptr = ppPtrs[i];
+
+		if (!ptr)
+			continue;
+
+		if (guard_owns(ptr)) {
+			guard_free(ptr, __builtin_return_address(0));
+			continue;
+		}
+
+		slab_t *pSlab = slab_of(ptr);
+
+		if (!pSlab && ((header_t *)ptr - 1)->data.is_sampled)
+			prof_free(ptr);
+
+		if (!pSlab && ((header_t *)ptr - 1)->data.is_mmapped) {
+			mmap_free((header_t *)ptr - 1);
+			continue;
+		}
+
+		// Objects of a batch usually share an arena: the lock is only switched when the owner changes
+		arena_t *pArena = owner_arena(ptr, pSlab);
+		if (pArena != pLocked) {
+			if (pLocked)
+				pthread_mutex_unlock(&pLocked->lock);
+			arena_lock(pArena);
+			pLocked = pArena;
+		}
+
+		arena_free(pArena, ptr);
+	}
+
+	if (pLocked)
+		pthread_mutex_unlock(&pLocked->lock);
+}
+
+// ***********************************************************************
+// Aligned Allocation
+// ***********************************************************************
+
+// 'alignment' must be a power of two
+static void *aligned_alloc_impl(size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if (trace_on && !trace_busy)
+		return trace_alloc(DALLOC_TRACE_ALIGNED, NULL, size, alignment);
+
+	if (alignment <= ALIGNMENT)
+		return dalloc(size);
+
+	if (size == 0 || size > SIZE_MAX / 2 || alignment > SIZE_MAX / 4)
+		return NULL;
+
+	if (guard_rate && guard_tick() && (ptr = guard_alloc(size, alignment, __builtin_return_address(0))))
+		return ptr;
+
+	// Small sizes: slab objects start at SLAB_HEADER_SIZE and follow each other by
+	// the class size, so a class that is a multiple of the alignment is aligned too.
+	// The cache may also hold heap blocks of that size, hence the check.
+	if (alignment <= SLAB_HEADER_SIZE && ALIGN_UP(size, alignment) <= SLAB_MAX_SIZE) {
+		if ((ptr = dalloc(ALIGN_UP(size, alignment))) && !((uintptr_t)ptr & (alignment - 1)))
+			return ptr;
+
+		dfree(ptr);
+	}
+
+	size_t aligned_size = ALIGN(size);
+	header_t *pHeader;
+
+	if (aligned_size >= mmap_threshold)
+		pHeader = mmap_alloc(aligned_size, alignment);
+	else {
+		arena_t *pArena = thread_arena();
+
+		arena_lock(pArena);
+		pHeader = heap_alloc_aligned(pArena, alignment, aligned_size);
+		pthread_mutex_unlock(&pArena->lock);
+	}
+
+	return pHeader ? (void *)(pHeader + 1) : NULL;
+}
+
+void *daligned_alloc(size_t alignment, size_t size)
+{
+	dalloc_init();
+
+	if (!alignment || (alignment & (alignment - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return aligned_alloc_impl(alignment, size);
+}
+
+int dposix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	dalloc_init();
+
+	// POSIX: a power of two multiple of sizeof(void *)
+	if (alignment < sizeof(void *) || (alignment & (alignment - 1)))
+		return EINVAL;
+
+	if (size == 0) {
+		*memptr = NULL;
+		return 0;
+	}
+
+	void *ptr = aligned_alloc_impl(alignment, size);
+	if (!ptr)
+		return ENOMEM;
+
+	*memptr = ptr;
+	return 0;
+}
+
+void *dmemalign(size_t alignment, size_t size)
+{
+	dalloc_init();
+
+	// Legacy interface: an alignment that is not a power of two is rounded up to one
+	if (alignment & (alignment - 1)) {
+		if (alignment > SIZE_MAX / 4) {
+			errno = EINVAL;
+			return NULL;
+		}
+		alignment = (size_t)1 << (fls_size(alignment) + 1);
+	}
+
+	return aligned_alloc_impl(alignment, size);
+}
+
+void *dvalloc(size_t size)
+{
+	dalloc_init();
+
+	return aligned_alloc_impl(page_size, size);
+}
+
+int dallopt(int param, int value)
+{
+	dalloc_init();	// So that the defaults do not overwrite the value later
+
+	switch (param) {
+	case DALLOC_OPT_TCACHE_COUNT:
+		if (value < 0 || value > TCACHE_COUNT_MAX)
+			return 0;
+		tcache_count = value;
+		return 1;
+
+	case DALLOC_OPT_ARENA_COUNT:
+		// Only threads that did not allocate yet are spread over the new count
+		if (value < 1 || value > ARENA_MAX)
+			return 0;
+		arena_count = value;
+		return 1;
+
+	case DALLOC_OPT_MMAP_THRESHOLD:
+		if (value < 0)
+			return 0;
+		mmap_threshold = value;
+		mmap_threshold_fixed = 1;
+		return 1;
+
+	case DALLOC_OPT_SLAB:
+		if (value != 0 && value != 1)
+			return 0;
+		slab_enabled = value;
+		return 1;
+
+	case DALLOC_OPT_HUGEPAGE:
+#ifdef MADV_HUGEPAGE
+		if (value != 0 && value != 1)
+			return 0;
+		hugepage_enabled = value;
+		return 1;
+#else
+		return 0;
+#endif
+
+	case DALLOC_OPT_PLACEMENT:
+		if (value < DALLOC_PLACEMENT_GOOD_FIT || value > DALLOC_PLACEMENT_NEXT_FIT)
+			return 0;
+		placement = value;
+		return 1;
+
+	case DALLOC_OPT_GUARD_RATE:
+		if (value < 0)
+			return 0;
+		guard_rate = value;
+		return 1;
+
+	case DALLOC_OPT_PROF_INTERVAL:
+		if (value < 0)
+			return 0;
+		if (value) {
+			// Load the unwinder now: its first backtrace() allocates
+			void *frame;
+			prof_busy = 1;
+			backtrace(&frame, 1);
+			prof_busy = 0;
+		}
+		prof_interval = value;
+		return 1;
+
+	case DALLOC_OPT_PROF_SIGNAL:
+		if (value <= 0 || value >= NSIG || value == SIGSEGV)
+			return 0;
+		return prof_signal_set(value);
+
+	case DALLOC_OPT_DECAY_MS:
+		if (value < 0)
+			return 0;
+		decay_ms = value;
+		return !value || purger_start();
+	}
+
+	return 0;
+}
+
+size_t dalloc_usable_size(void *ptr)
+{
+	dalloc_init();
+
+	if (!ptr)
+		return 0;
+
+	if (guard_owns(ptr))
+		return guard_usable_size(ptr);
+
+	return block_size(ptr, slab_of(ptr));
+}
+
+// ***********************************************************************
+// Statistics
+// ***********************************************************************
+
+/*
+ * dalloc_stats() walks every arena's block list and every slab, so it stops all
+ * allocation for a moment: call it from monitoring code, not from a hot loop.
+ * The arenas are locked in index order, the same order fork_prepare() uses.
+ */
+static const size_t stats_bin_limits[DALLOC_STATS_BINS - 1] = {
+	64, 256, 1024, 4096, 16 * 1024, 64 * 1024, 256 * 1024
+};
+
+void dalloc_stats(dalloc_stats_t *pStats)
+{
+	dalloc_init();
+
+	memset(pStats, 0, sizeof(*pStats));
+
+	for (unsigned i = 0; i < ARENA_MAX; ++i)
+		arena_lock(&arenas[i]);
+	pthread_mutex_lock(&slab_lock);
+
+	for (unsigned i = 0; i < ARENA_MAX; ++i) {
+		for (chunk_t *pChunk = arenas[i].pChunks; pChunk; pChunk = pChunk->pNext) {
+			header_t *pBlock = CHUNK_FIRST_BLOCK(pChunk);
+
+			for (; !pBlock->data.is_fence; pBlock = next_block(pBlock)) {
+				size_t size = pBlock->data.size;
+
+				++pStats->heap_blocks;
+
+				if (!pBlock->data.is_free) {
+					pStats->allocated_bytes += size;
+					continue;
+				}
+
+				unsigned bin = 0;
+				while (bin < DALLOC_STATS_BINS - 1 && size >= stats_bin_limits[bin])
+					++bin;
+
+				++pStats->free_blocks;
+				++pStats->free_blocks_by_size[bin];
+				pStats->free_bytes += size;
+				if (size > pStats->largest_free_block)
+					pStats->largest_free_block = size;
+			}
+		}
+	}
+
+	// Released (empty) slabs read as zeros, so they count as empty
+	for (size_t offset = 0; offset < slab_cut; offset += SLAB_SIZE) {
+		slab_t *pSlab = (slab_t *)(pSlabBase + offset);
+
+		pStats->slab_objects += pSlab->used;
+		pStats->allocated_bytes += (size_t)pSlab->used * pSlab->size;
+	}
+	pStats->slab_bytes = slab_committed;
+
+	pthread_mutex_unlock(&slab_lock);
+	for (unsigned i = ARENA_MAX; i-- > 0;)
+		pthread_mutex_unlock(&arenas[i].lock);
+
+	pStats->mmapped_blocks = STAT_GET(mmap_blocks);
+	pStats->mmapped_bytes = STAT_GET(mmap_bytes);
+	pStats->allocated_bytes += pStats->mmapped_bytes;
+	pStats->mapped_bytes = STAT_GET(heap_bytes) + pStats->slab_bytes + pStats->mmapped_bytes;
+
+	// 0 when all free memory is one block, close to 1 when it is scattered in small pieces
+	if (pStats->free_bytes)
+		pStats->fragmentation = 1.0 - (double)pStats->largest_free_block / pStats->free_bytes;
+
+	pStats->mprotect_calls = STAT_GET(mprotect_calls);
+	pStats->mmap_calls = STAT_GET(mmap_calls);
+	pStats->mremap_calls = STAT_GET(mremap_calls);
+	pStats->munmap_calls = STAT_GET(munmap_calls);
+	pStats->madvise_calls = STAT_GET(madvise_calls);
+	pStats->lock_waits = STAT_GET(lock_waits);
+	pStats->lock_wait_ns = STAT_GET(lock_wait_ns);
+	pStats->remote_frees = STAT_GET(remote_frees);
+	pStats->hugepage_advised_bytes = STAT_GET(hugepage_advised_bytes);
+	pStats->guarded_allocs = STAT_GET(guarded_allocs);
+}
+
+void dalloc_stats_print(void)
+{
+	static const char *bin_names[DALLOC_STATS_BINS] = {
+		"< 64", "< 256", "< 1K", "< 4K", "< 16K", "< 64K", "< 256K", ">= 256K"
+	};
+	dalloc_stats_t stats;
+
+	dalloc_stats(&stats);
+
+	fprintf(stderr, "*** dalloc stats ***\n");
+	fprintf(stderr, "mapped:        %12zu bytes (slabs %zu, mmapped %zu in %zu blocks)\n",
+		stats.mapped_bytes, stats.slab_bytes, stats.mmapped_bytes, stats.mmapped_blocks);
+	fprintf(stderr, "huge pages:    %12zu bytes advised\n", stats.hugepage_advised_bytes);
+	fprintf(stderr, "allocated:     %12zu bytes (%zu slab objects)\n", stats.allocated_bytes, stats.slab_objects);
+	fprintf(stderr, "free:          %12zu bytes in %zu of %zu heap blocks\n",
+		stats.free_bytes, stats.free_blocks, stats.heap_blocks);
+	fprintf(stderr, "largest free:  %12zu bytes, fragmentation %.1f%%\n",
+		stats.largest_free_block, stats.fragmentation * 100.0);
+
+	for (unsigned bin = 0; bin < DALLOC_STATS_BINS; ++bin)
+		fprintf(stderr, "  free %-8s %10zu blocks\n", bin_names[bin], stats.free_blocks_by_size[bin]);
+
+	fprintf(stderr, "syscalls:      mmap %llu, mprotect %llu, mremap %llu, munmap %llu, madvise %llu\n",
+		stats.mmap_calls, stats.mprotect_calls, stats.mremap_calls, stats.munmap_calls, stats.madvise_calls);
+	fprintf(stderr, "lock waits:    %llu, %.3f ms in total\n", stats.lock_waits, stats.lock_wait_ns / 1e6);
+	fprintf(stderr, "remote frees:  %llu\n", stats.remote_frees);
+	fprintf(stderr, "guarded:       %llu sampled allocations\n", stats.guarded_allocs);
+}
+
+// ***********************************************************************
+// Startup (constructor)
+// ***********************************************************************
+
+// Environment variables read at startup, e.g. for programs running under LD_PRELOAD
+static const struct {
+	const char *name;
+	int param;
+} dalloc_env[] = {
+	{ "DALLOC_TCACHE_COUNT",	DALLOC_OPT_TCACHE_COUNT },
+	{ "DALLOC_ARENA_COUNT",		DALLOC_OPT_ARENA_COUNT },
+	{ "DALLOC_MMAP_THRESHOLD",	DALLOC_OPT_MMAP_THRESHOLD },
+	{ "DALLOC_DECAY_MS",		DALLOC_OPT_DECAY_MS },
+	{ "DALLOC_SLAB",			DALLOC_OPT_SLAB },
+	{ "DALLOC_HUGEPAGE",		DALLOC_OPT_HUGEPAGE },
+	{ "DALLOC_GUARD_RATE",		DALLOC_OPT_GUARD_RATE },
+	{ "DALLOC_PROF_INTERVAL",	DALLOC_OPT_PROF_INTERVAL },
+	{ "DALLOC_PROF_SIGNAL",		DALLOC_OPT_PROF_SIGNAL },
+	{ "DALLOC_PLACEMENT",		DALLOC_OPT_PLACEMENT },
+};
+
+/*
+ * fork() only copies the calling thread. A lock held by any other thread at that
+ * moment would stay locked forever in the child, so all of them are taken before
+ * fork() and released (re-created in the child, which has a new thread id) after.
+ */
+static void fork_prepare(void)
+{
+	for (unsigned i = 0; i < ARENA_MAX; ++i)
+		pthread_mutex_lock(&arenas[i].lock);
+
+	pthread_mutex_lock(&slab_lock);
+	pthread_mutex_lock(&guard_lock);
+	pthread_mutex_lock(&prof_lock);
+	pthread_mutex_lock(&trace_lock);
+}
+
+static void fork_parent(void)
+{
+	pthread_mutex_unlock(&trace_lock);
+	pthread_mutex_unlock(&prof_lock);
+	pthread_mutex_unlock(&guard_lock);
+	pthread_mutex_unlock(&slab_lock);
+
+	for (unsigned i = ARENA_MAX; i-- > 0;)
+		pthread_mutex_unlock(&arenas[i].lock);
+}
+
+static void fork_child(void)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+
+	for (unsigned i = 0; i < ARENA_MAX; ++i)
+		pthread_mutex_init(&arenas[i].lock, &attr);
+
+	pthread_mutexattr_destroy(&attr);
+
+	pthread_mutex_init(&slab_lock, NULL);
+	pthread_mutex_init(&guard_lock, NULL);
+	pthread_mutex_init(&prof_lock, NULL);
+	pthread_mutex_init(&trace_lock, NULL);
+
+	// The trace belongs to the parent: the child neither writes to it nor
+	// writes the parent's buffered records again. Its thread keeps its buffer.
+	if (trace_fd >= 0) {
+		trace_on = 0;
+		close(trace_fd);
+		trace_fd = -1;
+	}
+
+	for (trace_buffer_t *pBuffer = pTraceBuffers; pBuffer; pBuffer = pBuffer->pNext) {
+		pBuffer->busy = 0;
+		pBuffer->count = 0;
+		pBuffer->owned = pBuffer == pTraceBuffer;
+	}
+
+	// The purger thread was not copied: the child's first call goes through dalloc_init_slow() again,
+	// which starts a new one
+	purger_started = 0;
+	pthread_mutex_init(&purger_lock, NULL);
+	init_claimed = 0;
+	__atomic_store_n(&initialized, 0, __ATOMIC_RELEASE);
+
+	// Neither was the profile dumper: the next sample starts it again (see prof_alloc).
+	// A dumper of the parent may have been inside sem_wait(): the semaphore starts over too.
+	if (prof_signal) {
+		prof_dumper_started = 0;
+		sem_init(&prof_dump_sem, 0, 0);
+	}
+}
+
+static void dalloc_startup(void)
+{
+	dalloc_init();
+
+	for (unsigned i = 0; i < sizeof(dalloc_env) / sizeof(dalloc_env[0]); ++i) {
+		const char *value = getenv(dalloc_env[i].name);
+		if (value)
+			dallopt(dalloc_env[i].param, (int)strtol(value, NULL, 0));
+	}
+
+	const char *pTracePath = getenv("DALLOC_TRACE");
+	if (pTracePath && dalloc_trace_start(pTracePath) != 0)
+		fprintf(stderr, "dalloc: cannot write the trace to %s\n", pTracePath);
+
+	pthread_atfork(fork_prepare, fork_parent, fork_child);
 }
@@ -2,6 +2,7 @@
 #define DALLOC_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 // *** Core API (v1.0) ***
 void *dalloc(size_t size);
@@ -22,4 +23,186 @@ void *dcalloc(size_t num, size_t size);
  */
 void *drealloc(void *ptr, size_t new_size);
 
+/*
+ * sized free: Like dfree(), for callers that know the size they requested
+ * (or any size up to dalloc_usable_size()). Small blocks skip the size lookup.
+ */
+void dfree_sized(void *ptr, size_t size);
+
+// *** Batch API (v3.0) ***
+
+/*
+ * batch: Allocates 'count' blocks of 'size' bytes each, under a single lock.
+ * The pointers are stored in ppOut[0 .. count-1]. Returns how many were allocated:
+ * less than 'count' only if memory ran out (the ones returned are still valid).
+ * Each block counts as one dalloc() call for guard sampling and the heap profiler.
+ */
+size_t dalloc_batch(size_t size, size_t count, void **ppOut);
+
+/*
+ * Frees 'count' blocks at once (NULL entries are skipped).
+ * The blocks can come from dalloc_batch() or any other dalloc function.
+ */
+void dfree_batch(void **ppPtrs, size_t count);
+
+// *** Aligned API (v3.0) ***
+// Blocks returned by these are released with the plain dfree().
+
+/*
+ * aligned_alloc: Allocates 'size' bytes at an address that is a multiple of 'alignment'.
+ * 'alignment' must be a power of two, otherwise NULL is returned (errno = EINVAL).
+ * Example: 64 for cache-line aligned queues, 4096 for O_DIRECT buffers.
+ */
+void *daligned_alloc(size_t alignment, size_t size);
+
+/*
+ * posix_memalign: Same as daligned_alloc, the result is stored in *memptr.
+ * 'alignment' must be a power of two multiple of sizeof(void *).
+ * Returns 0 on success, EINVAL for a bad alignment or ENOMEM (*memptr is left untouched).
+ */
+int dposix_memalign(void **memptr, size_t alignment, size_t size);
+
+// memalign: Legacy version, an alignment that is not a power of two is rounded up to one.
+void *dmemalign(size_t alignment, size_t size);
+
+// valloc: Page-aligned allocation.
+void *dvalloc(size_t size);
+
+/*
+ * malloc_usable_size: Number of bytes the block can really hold.
+ * It may be more than requested (alignment, size class); all of it can be used.
+ */
+size_t dalloc_usable_size(void *ptr);
+
+// *** Tuning API (v3.0) ***
+
+// Parameters for dallopt()
+#define DALLOC_OPT_TCACHE_COUNT		1	// Blocks kept per size bin in each thread's cache (0 turns the cache off)
+#define DALLOC_OPT_ARENA_COUNT		2	// Number of arenas new threads are spread over (default: number of CPUs)
+#define DALLOC_OPT_MMAP_THRESHOLD	3	// Requests of at least this many bytes get their own mmap() (default: 128 KiB, raised up to 32 MiB by frees of such blocks unless set)
+#define DALLOC_OPT_DECAY_MS			4	// Free pages unused for this many ms are given back by a background thread (0: off)
+#define DALLOC_OPT_SLAB				5	// 1: requests up to 512 bytes come from header-less slabs (default), 0: from the heap
+#define DALLOC_OPT_HUGEPAGE			6	// 1: the heap grows in 2 MiB-aligned segments advised for transparent huge pages (default: 0)
+#define DALLOC_OPT_GUARD_RATE		7	// 1 allocation in N (up to a page) gets guard pages to catch overflows and use after free (0: off)
+#define DALLOC_OPT_PROF_INTERVAL	8	// Heap profiler: one allocation per N bytes on average is recorded with its backtrace (0: off)
+#define DALLOC_OPT_PROF_SIGNAL		9	// This signal writes a heap profile to dalloc.<pid>.<n>.heap (e.g. SIGUSR2 = 12)
+#define DALLOC_OPT_PLACEMENT		10	// Which free heap block a request gets, one of DALLOC_PLACEMENT_* (default: good-fit)
+
+// Values of DALLOC_OPT_PLACEMENT
+#define DALLOC_PLACEMENT_GOOD_FIT	0	// Constant time, the block may be up to 1/16 larger than the best one
+#define DALLOC_PLACEMENT_BEST_FIT	1	// Smallest block that fits (scans up to two size lists)
+#define DALLOC_PLACEMENT_FIRST_FIT	2	// First block that fits in address order (walks the heap)
+#define DALLOC_PLACEMENT_NEXT_FIT	3	// First-fit from where the last search stopped (walks the heap)
+
+/*
+ * mallopt-style tuning: sets the allocator parameter 'param' to 'value'.
+ * Returns 1 on success, 0 if the parameter is unknown or the value is out of range.
+ */
+int dallopt(int param, int value);
+
+/*
+ * trim: Gives free heap memory back to the OS.
+ * - Decommits the end of an arena's heap when its last block is free, keeping 'pad' bytes of it.
+ * - Releases the whole pages inside large free blocks with madvise().
+ * Returns 1 if any memory was released, 0 otherwise.
+ */
+int dalloc_trim(size_t pad);
+
+// *** Profiling API (v3.0) ***
+
+/*
+ * prof_dump: Writes the sampled blocks that are still allocated, grouped by
+ * backtrace, to the file 'path' in the legacy pprof heap format:
+ *   pprof --text <program> <path>
+ * Needs DALLOC_OPT_PROF_INTERVAL. Returns 0 on success, -1 (errno set) otherwise.
+ */
+int dalloc_prof_dump(const char *path);
+
+// *** Tracing API (v3.0) ***
+
+/*
+ * trace_start: Records every allocation call of the program (dalloc, dcalloc,
+ * drealloc, dfree and the aligned and batch versions) to the file 'path', until
+ * dalloc_trace_stop() or exit. The DALLOC_TRACE=<path> environment variable
+ * starts it too. The trace is replayed by './dalloc_replay <path>'.
+ * Returns 0 on success, -1 (errno set) otherwise.
+ */
+int dalloc_trace_start(const char *path);
+
+// trace_stop: Writes the records still buffered and closes the trace.
+void dalloc_trace_stop(void);
+
+/*
+ * Trace file: a dalloc_trace_header_t, then the records. Each thread's records
+ * are in order, the threads' groups of them are interleaved: sort by time_ns.
+ * An object is known by its address, which is only reused after a record freed it.
+ */
+#define DALLOC_TRACE_MAGIC		"DALTRACE"
+#define DALLOC_TRACE_VERSION	1
+
+enum {
+	DALLOC_TRACE_ALLOC = 1,		// dalloc, dalloc_batch (one record per block)
+	DALLOC_TRACE_CALLOC,		// dcalloc, 'size' is the product of its arguments
+	DALLOC_TRACE_ALIGNED,		// daligned_alloc & co, 'arg' is the alignment
+	DALLOC_TRACE_REALLOC,		// drealloc starts: 'id' is the old block (0: none)
+	DALLOC_TRACE_REALLOC_END,	// ... and returns: 'id' is the new block (0: freed, or failed if 'size' != 0)
+	DALLOC_TRACE_FREE,			// dfree & co, recorded before the block is freed
+};
+
+typedef struct dalloc_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+} dalloc_trace_header_t;
+
+typedef struct dalloc_trace_record {
+	uint64_t time_ns:48;	// Since dalloc_trace_start() (wraps after 78 hours)
+	uint64_t thread:16;		// Threads are numbered from 1, in the order they first allocate
+	uint64_t size:56;		// Requested size
+	uint64_t op:8;			// DALLOC_TRACE_*
+	uint64_t id;			// Address of the block returned or freed
+	uint64_t arg;
+} dalloc_trace_record_t;		// 32 bytes
+
+// *** Statistics API (v3.0) ***
+
+#define DALLOC_STATS_BINS	8	// Free blocks by size: < 64, < 256, < 1K, < 4K, < 16K, < 64K, < 256K, larger
+
+typedef struct dalloc_stats {
+	size_t mapped_bytes;		// Taken from the OS: heap, slabs and mmapped blocks (madvise'd pages included)
+	size_t slab_bytes;			// ... of which slab pages
+	size_t mmapped_bytes;		// ... of which blocks with their own mapping
+	size_t mmapped_blocks;
+	size_t hugepage_advised_bytes;	// ... of which advised for transparent huge pages (DALLOC_OPT_HUGEPAGE), not all of it may be backed by them
+
+	size_t allocated_bytes;		// Handed out (blocks waiting in a thread cache count as handed out)
+	size_t slab_objects;		// Slab objects handed out
+
+	size_t heap_blocks;			// Blocks in the arena lists, used and free
+	size_t free_blocks;
+	size_t free_bytes;
+	size_t largest_free_block;
+	size_t free_blocks_by_size[DALLOC_STATS_BINS];
+	double fragmentation;		// External fragmentation: 1 - largest_free_block / free_bytes
+
+	unsigned long long mprotect_calls;	// Segment commits
+	unsigned long long mmap_calls;
+	unsigned long long mremap_calls;
+	unsigned long long munmap_calls;
+	unsigned long long madvise_calls;
+	unsigned long long lock_waits;		// Times a thread found an arena locked
+	unsigned long long lock_wait_ns;	// Total time spent waiting for it
+	unsigned long long remote_frees;	// dfree() calls that queued the block instead of waiting
+	unsigned long long guarded_allocs;	// Allocations sampled into guard pages (DALLOC_OPT_GUARD_RATE)
+} dalloc_stats_t;
+
+/*
+ * stats: Fills 'pStats' with a snapshot of the heap.
+ * It briefly locks every arena, so it is meant for monitoring, not for hot paths.
+ */
+void dalloc_stats(dalloc_stats_t *pStats);
+
+// malloc_stats: Prints the snapshot to stderr in human readable form.
+void dalloc_stats_print(void);
+
 #endif
@@ -0,0 +1,436 @@
+/*
+ * dalloc_bench.c
+ *
+ * Allocator benchmark suite. The same source is built twice by 'make bench':
+ *   dalloc_bench      -> dalloc (compiled in, -O2)
+ *   dalloc_bench_sys  -> the system malloc (-DBENCH_SYSTEM)
+ * so both columns come from exactly the same workloads.
+ *
+ * Usage: ./dalloc_bench [threads] [scale]
+ *
+ * Every workload runs in its own child process (fork), so peak RSS and the
+ * heap left behind by one workload do not leak into the numbers of the next.
+ *
+ * Reported per workload:
+ *   Mops/s          : allocations + frees (+ reallocs) per second, all threads together
+ *   p50/p99/p999    : latency of single calls in ns (1 call in LAT_SAMPLE is timed)
+ *   rss             : peak RSS growth during the workload
+ *   frag            : share of that RSS not holding live data (1 - peak live / rss)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "dalloc_harness.h"
+
+#ifdef BENCH_SYSTEM
+	#define ALLOC(size)				malloc(size)
+	#define FREE(ptr)				free(ptr)
+	#define REALLOC(ptr, size)		realloc(ptr, size)
+	#define ALLOCATOR_NAME			"system malloc"
+#else
+	#include "dalloc.h"
+	#define ALLOC(size)				dalloc(size)
+	#define FREE(ptr)				dfree(ptr)
+	#define REALLOC(ptr, size)		drealloc(ptr, size)
+	#define ALLOCATOR_NAME			"dalloc"
+#endif
+
+#define LAT_SAMPLE		16			// Time 1 call in 16, the clock costs as much as a cached allocation
+#define LAT_MAX			(1 << 20)	// Latency samples kept per thread
+#define MAX_THREADS		64
+
+// ***********************************************************************
+// Measurement helpers
+// ***********************************************************************
+
+typedef struct {
+	int id;
+	unsigned seed;
+	const void *pArg;		// Workload parameter (size for the sweeps)
+
+	uint64_t ops;
+	size_t live;			// Bytes requested and not freed yet
+	size_t peak;			// Highest 'live' seen by this thread
+
+	uint32_t *pLat;
+	size_t lat_count;
+} worker_t;
+
+static int thread_count = 4;
+static long scale = 1;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// xorshift: rand() takes a lock in glibc, it would measure itself
+static inline unsigned next_rand(worker_t *pW)
+{
+	unsigned x = pW->seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return pW->seed = x;
+}
+
+// Small sizes dominate real programs: half of the requests are 16..64 bytes
+static inline size_t random_size(worker_t *pW, size_t max)
+{
+	unsigned r = next_rand(pW);
+	size_t limit = (r & 1) ? 64 : max;
+	return 16 + (r >> 1) % (limit - 15);
+}
+
+static inline void *bench_alloc(worker_t *pW, size_t size)
+{
+	void *ptr;
+
+	if (++pW->ops % LAT_SAMPLE == 0 && pW->lat_count < LAT_MAX) {
+		uint64_t t0 = now_ns();
+		ptr = ALLOC(size);
+		pW->pLat[pW->lat_count++] = (uint32_t)(now_ns() - t0);
+	} else {
+		ptr = ALLOC(size);
+	}
+
+	if (!ptr) {
+		fprintf(stderr, "bench: out of memory (%zu bytes)\n", size);
+		exit(1);
+	}
+
+	// Touch every page, as a real program would: RSS then shows what the allocator really costs
+	for (size_t i = 0; i < size; i += 4096)
+		((volatile char *)ptr)[i] = 1;
+
+	pW->live += size;
+	if (pW->live > pW->peak)
+		pW->peak = pW->live;
+
+	return ptr;
+}
+
+static inline void bench_free(worker_t *pW, void *ptr, size_t size)
+{
+	if (++pW->ops % LAT_SAMPLE == 0 && pW->lat_count < LAT_MAX) {
+		uint64_t t0 = now_ns();
+		FREE(ptr);
+		pW->pLat[pW->lat_count++] = (uint32_t)(now_ns() - t0);
+	} else {
+		FREE(ptr);
+	}
+
+	// Cross-thread frees can make one thread's counter go "negative"; the sum stays right
+	pW->live -= size;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+// ***********************************************************************
+// Workloads
+// ***********************************************************************
+
+// 1. Single-thread churn: random frees and allocations over a fixed set of slots
+#define CHURN_SLOTS 4096
+
+static void *churn_routine(void *arg)
+{
+	worker_t *pW = arg;
+	static void *pSlots[CHURN_SLOTS];
+	static size_t sizes[CHURN_SLOTS];
+
+	for (long i = 0; i < 2000000 * scale; ++i) {
+		unsigned slot = next_rand(pW) % CHURN_SLOTS;
+
+		if (pSlots[slot]) {
+			bench_free(pW, pSlots[slot], sizes[slot]);
+			pSlots[slot] = NULL;
+		} else {
+			sizes[slot] = random_size(pW, 512);
+			pSlots[slot] = bench_alloc(pW, sizes[slot]);
+		}
+	}
+
+	for (unsigned i = 0; i < CHURN_SLOTS; ++i)
+		if (pSlots[i])
+			bench_free(pW, pSlots[i], sizes[i]);
+
+	return NULL;
+}
+
+// 2. Size sweep: allocate a batch of one size, free it, again (every thread, no sharing)
+#define SWEEP_BATCH 64
+
+static void *sweep_routine(void *arg)
+{
+	worker_t *pW = arg;
+	size_t size = *(const size_t *)pW->pArg;
+	void *pBatch[SWEEP_BATCH];
+
+	// The same amount of bytes for every size, at least a few rounds for the big ones
+	long rounds = (long)((2000000000ull * scale) / (size * SWEEP_BATCH));
+	if (rounds < 64)
+		rounds = 64;
+
+	for (long r = 0; r < rounds; ++r) {
+		for (int i = 0; i < SWEEP_BATCH; ++i)
+			pBatch[i] = bench_alloc(pW, size);
+		for (int i = 0; i < SWEEP_BATCH; ++i)
+			bench_free(pW, pBatch[i], size);
+	}
+
+	return NULL;
+}
+
+// 3. Producer/consumer: even threads allocate, odd threads free what their partner produced
+#define RING_SIZE 1024
+
+typedef struct {
+	void *pItems[RING_SIZE];
+	size_t sizes[RING_SIZE];
+	volatile unsigned head;		// Written by the producer only
+	volatile unsigned tail;		// Written by the consumer only
+} ring_t;
+
+static ring_t rings[MAX_THREADS / 2];
+
+static void *prodcon_routine(void *arg)
+{
+	worker_t *pW = arg;
+	ring_t *pRing = &rings[pW->id / 2];
+	long count = 1000000 * scale;
+
+	if (pW->id % 2 == 0) {
+		for (long i = 0; i < count; ++i) {
+			while (pRing->head - __atomic_load_n(&pRing->tail, __ATOMIC_ACQUIRE) == RING_SIZE)
+				sched_yield();
+
+			unsigned slot = pRing->head % RING_SIZE;
+			pRing->sizes[slot] = random_size(pW, 512);
+			pRing->pItems[slot] = bench_alloc(pW, pRing->sizes[slot]);
+			__atomic_store_n(&pRing->head, pRing->head + 1, __ATOMIC_RELEASE);
+		}
+	} else {
+		for (long i = 0; i < count; ++i) {
+			while (__atomic_load_n(&pRing->head, __ATOMIC_ACQUIRE) == pRing->tail)
+				sched_yield();
+
+			unsigned slot = pRing->tail % RING_SIZE;
+			bench_free(pW, pRing->pItems[slot], pRing->sizes[slot]);
+			__atomic_store_n(&pRing->tail, pRing->tail + 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	return NULL;
+}
+
+// 4. Realloc growth: buffers growing in small steps up to 1 MiB, like a string builder
+static void *realloc_routine(void *arg)
+{
+	worker_t *pW = arg;
+
+	for (long r = 0; r < 200 * scale; ++r) {
+		size_t size = 16;
+		char *pBuffer = bench_alloc(pW, size);
+
+		while (size < (1 << 20)) {
+			size_t new_size = size + 16 + next_rand(pW) % (size / 4 + 1);
+			char *pNew;
+
+			if (++pW->ops % LAT_SAMPLE == 0 && pW->lat_count < LAT_MAX) {
+				uint64_t t0 = now_ns();
+				pNew = REALLOC(pBuffer, new_size);
+				pW->pLat[pW->lat_count++] = (uint32_t)(now_ns() - t0);
+			} else {
+				pNew = REALLOC(pBuffer, new_size);
+			}
+
+			if (!pNew) {
+				fprintf(stderr, "bench: realloc failed (%zu bytes)\n", new_size);
+				exit(1);
+			}
+
+			pNew[new_size - 1] = 1;
+			pW->live += new_size - size;
+			if (pW->live > pW->peak)
+				pW->peak = pW->live;
+
+			pBuffer = pNew;
+			size = new_size;
+		}
+
+		bench_free(pW, pBuffer, size);
+	}
+
+	return NULL;
+}
+
+// 5. Larson: server simulation. Each thread replaces random objects of its slot array;
+// after a round the arrays move to the next thread, so most objects die on another thread.
+#define LARSON_SLOTS 1024
+#define LARSON_ROUNDS 10
+
+typedef struct {
+	void *pItems[LARSON_SLOTS];
+	size_t sizes[LARSON_SLOTS];
+} larson_set_t;
+
+static larson_set_t larson_sets[MAX_THREADS];
+static pthread_barrier_t larson_barrier;
+
+static void *larson_routine(void *arg)
+{
+	worker_t *pW = arg;
+
+	for (int round = 0; round < LARSON_ROUNDS; ++round) {
+		larson_set_t *pSet = &larson_sets[(pW->id + round) % thread_count];
+
+		for (long i = 0; i < 100000 * scale; ++i) {
+			unsigned slot = next_rand(pW) % LARSON_SLOTS;
+
+			if (pSet->pItems[slot])
+				bench_free(pW, pSet->pItems[slot], pSet->sizes[slot]);
+
+			pSet->sizes[slot] = random_size(pW, 1024);
+			pSet->pItems[slot] = bench_alloc(pW, pSet->sizes[slot]);
+		}
+
+		// Hand the set over only when its current owner is done with it
+		pthread_barrier_wait(&larson_barrier);
+	}
+
+	if (pW->id == 0)
+		for (int t = 0; t < thread_count; ++t)
+			for (int i = 0; i < LARSON_SLOTS; ++i)
+				if (larson_sets[t].pItems[i])
+					bench_free(pW, larson_sets[t].pItems[i], larson_sets[t].sizes[i]);
+
+	return NULL;
+}
+
+// ***********************************************************************
+// Runner
+// ***********************************************************************
+
+typedef struct {
+	const char *name;
+	void *(*routine)(void *);
+	int single;			// 1: always one thread
+	size_t size;		// Parameter of the size sweep
+} workload_t;
+
+static const workload_t workloads[] = {
+	{ "churn",			churn_routine,		1, 0 },
+	{ "sweep-16",		sweep_routine,		0, 16 },
+	{ "sweep-256",		sweep_routine,		0, 256 },
+	{ "sweep-4K",		sweep_routine,		0, 4096 },
+	{ "sweep-64K",		sweep_routine,		0, 65536 },
+	{ "sweep-1M",		sweep_routine,		0, 1 << 20 },
+	{ "prodcon",		prodcon_routine,	0, 0 },
+	{ "realloc",		realloc_routine,	0, 0 },
+	{ "larson",			larson_routine,		0, 0 },
+};
+
+static void run_workload(const workload_t *pLoad)
+{
+	int threads = pLoad->single ? 1 : thread_count;
+	if (pLoad->routine == prodcon_routine && threads % 2)
+		threads = threads > 1 ? threads - 1 : 2;	// Producers and consumers come in pairs
+
+	pthread_t tids[MAX_THREADS];
+	static worker_t workers[MAX_THREADS];
+
+	for (int i = 0; i < threads; ++i) {
+		workers[i] = (worker_t){ .id = i, .seed = 2463534242u + i * 7919, .pArg = &pLoad->size };
+		workers[i].pLat = malloc(LAT_MAX * sizeof(uint32_t));
+		// Fault it in before the clock starts (not with 0: malloc + memset 0 would become calloc)
+		memset(workers[i].pLat, 0xff, LAT_MAX * sizeof(uint32_t));
+	}
+
+	pthread_barrier_init(&larson_barrier, NULL, threads);
+
+	reset_peak_rss();
+	size_t rss_start = status_kb("VmRSS:");
+	uint64_t t0 = now_ns();
+
+	for (int i = 0; i < threads; ++i)
+		pthread_create(&tids[i], NULL, pLoad->routine, &workers[i]);
+	for (int i = 0; i < threads; ++i)
+		pthread_join(tids[i], NULL);
+
+	double seconds = (now_ns() - t0) / 1e9;
+	size_t rss_peak = status_kb("VmHWM:");
+
+	uint64_t ops = 0;
+	size_t live_peak = 0, lat_total = 0;
+	for (int i = 0; i < threads; ++i) {
+		ops += workers[i].ops;
+		live_peak += workers[i].peak;	// Upper bound: the threads do not peak at the same moment
+		lat_total += workers[i].lat_count;
+	}
+
+	uint32_t *pAll = malloc((lat_total + 1) * sizeof(uint32_t));
+	size_t n = 0;
+	for (int i = 0; i < threads; ++i) {
+		memcpy(pAll + n, workers[i].pLat, workers[i].lat_count * sizeof(uint32_t));
+		n += workers[i].lat_count;
+	}
+	qsort(pAll, n, sizeof(uint32_t), cmp_u32);
+
+	// The latency buffers were faulted in before rss_start, the workload can only add to it
+	size_t rss_grow = rss_peak > rss_start ? rss_peak - rss_start : 0;
+	double frag = rss_grow > live_peak ? 1.0 - (double)live_peak / rss_grow : 0.0;
+
+	printf("%-12s %3d %10.3f %8u %8u %8u %10.1f %6.1f%%\n",
+		pLoad->name, threads, ops / seconds / 1e6,
+		n ? pAll[n / 2] : 0, n ? pAll[n * 99 / 100] : 0, n ? pAll[n * 999 / 1000] : 0,
+		rss_grow / (1024.0 * 1024.0), frag * 100.0);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+		thread_count = atoi(argv[1]);
+	if (argc > 2)
+		scale = atol(argv[2]);
+
+	if (thread_count < 1 || thread_count > MAX_THREADS || scale < 1) {
+		fprintf(stderr, "usage: %s [threads 1..%d] [scale >= 1]\n", argv[0], MAX_THREADS);
+		return 1;
+	}
+
+	printf("*** %s: %d threads, scale %ld ***\n", ALLOCATOR_NAME, thread_count, scale);
+	printf("%-12s %3s %10s %8s %8s %8s %10s %7s\n",
+		"workload", "thr", "Mops/s", "p50 ns", "p99 ns", "p999 ns", "rss MiB", "frag");
+
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); ++i) {
+		fflush(stdout);
+
+		pid_t pid = fork();
+		if (pid == 0) {
+			run_workload(&workloads[i]);
+			fflush(stdout);
+			_exit(0);
+		}
+
+		int status;
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			printf("%-12s failed (status %d)\n", workloads[i].name, status);
+	}
+
+	return 0;
+}
@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dalloc_harness.h"
+
+size_t status_kb(const char *pKey)
+{
+	char line[256];
+	size_t kb = 0, len = strlen(pKey);
+	FILE *pFile = fopen("/proc/self/status", "r");
+
+	if (!pFile)
+		return 0;
+
+	while (fgets(line, sizeof(line), pFile))
+		if (strncmp(line, pKey, len) == 0) {
+			kb = strtoul(line + len + 1, NULL, 10);
+			break;
+		}
+
+	fclose(pFile);
+	return kb * 1024;
+}
+
+void reset_peak_rss(void)
+{
+	FILE *pFile = fopen("/proc/self/clear_refs", "w");
+
+	if (pFile) {
+		fputs("5", pFile);
+		fclose(pFile);
+	}
+}
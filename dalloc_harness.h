@@ -0,0 +1,18 @@
+#ifndef DALLOC_HARNESS_H
+#define DALLOC_HARNESS_H
+
+#include <stddef.h>
+
+/*
+ * dalloc_harness: helpers shared by the measuring tools (dalloc_bench and
+ * the like), so each of them measures the same way. Linux only: they read /proc.
+ */
+
+// Reads a "<key>: <n> kB" line of /proc/self/status (e.g. "VmRSS:", "VmHWM:"), in bytes. 0 if missing
+size_t status_kb(const char *pKey);
+
+// Starts the RSS high-water mark (VmHWM) again from the current RSS.
+// A forked child inherits the mark of its parent: call it before measuring a peak.
+void reset_peak_rss(void);
+
+#endif // DALLOC_HARNESS_H
@@ -0,0 +1,259 @@
+/*
+ * dalloc_placement.c
+ *
+ * Placement policy comparison: runs the same workloads under each
+ * DALLOC_OPT_PLACEMENT policy, so one can be picked per service from numbers.
+ *
+ * Usage: ./dalloc_placement [scale]     (or: make placement PLACEMENT_ARGS=<scale>)
+ *
+ * The walking policies (first-fit, next-fit) are slow by nature: the default
+ * scale is kept small so that they finish in seconds.
+ *
+ * The thread cache and the slabs are turned off: every request then goes
+ * through the free-block index, which is the only thing the policies change.
+ * Every run is a forked child with its own heap, seeded the same way, so every
+ * policy sees exactly the same requests. One thread: placement is per arena.
+ *
+ * A recorded program can be compared the same way, one policy at a time:
+ *   DALLOC_PLACEMENT=<0..3> ./dalloc_replay <trace>
+ *
+ * Reported per workload and policy:
+ *   Mops/s          : allocations + frees per second
+ *   p50/p99/p999    : latency of single allocations in ns (1 call in LAT_SAMPLE is timed)
+ *   rss             : peak RSS growth during the workload
+ *   frag            : share of that RSS not holding live data (1 - peak live / rss)
+ *   holes           : free heap blocks at the end of the steady phase
+ *   ext             : external fragmentation then (1 - largest free block / free bytes)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "dalloc.h"
+#include "dalloc_harness.h"
+
+#define LAT_SAMPLE		16			// Time 1 allocation in 16
+#define LAT_MAX			(1 << 20)	// Latency samples kept
+#define SLOTS			8192		// Objects alive at the same time (at most)
+
+static const char *policy_names[] = { "good-fit", "best-fit", "first-fit", "next-fit" };
+
+static long scale = 1;
+
+static unsigned seed;
+static uint64_t ops;
+static size_t live, live_peak;
+static uint32_t *pLat;
+static size_t lat_count;
+
+static void *pSlots[SLOTS];
+static size_t sizes[SLOTS];
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// xorshift: the same sequence for every policy
+static inline unsigned next_rand(void)
+{
+	unsigned x = seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return seed = x;
+}
+
+// Sizes from 16 bytes up to 'max' (a power of two), as many in each power of two range
+static inline size_t random_size(size_t max)
+{
+	unsigned bits = 4 + next_rand() % (__builtin_ctzl(max) - 4);
+	return ((size_t)1 << bits) + next_rand() % ((size_t)1 << bits);
+}
+
+static void place(unsigned slot, size_t size)
+{
+	void *ptr;
+
+	if (++ops % LAT_SAMPLE == 0 && lat_count < LAT_MAX) {
+		uint64_t t0 = now_ns();
+		ptr = dalloc(size);
+		pLat[lat_count++] = (uint32_t)(now_ns() - t0);
+	} else {
+		ptr = dalloc(size);
+	}
+
+	if (!ptr) {
+		fprintf(stderr, "placement: out of memory (%zu bytes)\n", size);
+		exit(1);
+	}
+
+	// Touch every page, as a real program would: RSS then shows the holes the policy leaves
+	for (size_t i = 0; i < size; i += 4096)
+		((volatile char *)ptr)[i] = 1;
+
+	pSlots[slot] = ptr;
+	sizes[slot] = size;
+	live += size;
+	if (live > live_peak)
+		live_peak = live;
+}
+
+static void release(unsigned slot)
+{
+	++ops;
+	dfree(pSlots[slot]);
+	pSlots[slot] = NULL;
+	live -= sizes[slot];
+}
+
+// ***********************************************************************
+// Workloads (steady phase only, the final frees are done by the runner)
+// ***********************************************************************
+
+// 1. Random frees and allocations of small and medium sizes
+static void churn_workload(void)
+{
+	for (long i = 0; i < 500000 * scale; ++i) {
+		unsigned slot = next_rand() % SLOTS;
+
+		if (pSlots[slot])
+			release(slot);
+		else
+			place(slot, random_size(1024));
+	}
+}
+
+// 2. Long-lived large blocks among short-lived small ones
+static void mixed_workload(void)
+{
+	for (long i = 0; i < 300000 * scale; ++i) {
+		// The first eighth of the slots are long-lived and large, the rest turn over fast
+		unsigned slot = next_rand() % SLOTS;
+		int long_lived = slot < SLOTS / 8;
+
+		if (pSlots[slot] && (!long_lived || next_rand() % 16 == 0))
+			release(slot);
+
+		if (!pSlots[slot])
+			place(slot, long_lived ? random_size(65536) : random_size(256));
+	}
+}
+
+// 3. Phases of growing sizes: the holes each phase leaves are too small for the next
+static void phases_workload(void)
+{
+	for (long round = 0; round < 5 * scale; ++round)
+		for (size_t size = 32; size <= 8192; size *= 2) {
+			for (unsigned slot = 0; slot < SLOTS; ++slot)
+				if (!pSlots[slot])
+					place(slot, size + next_rand() % size);
+
+			// Every other object dies, the survivors pin the memory around the holes
+			for (unsigned slot = next_rand() % 2; slot < SLOTS; slot += 2)
+				release(slot);
+		}
+}
+
+// ***********************************************************************
+// Runner
+// ***********************************************************************
+
+typedef struct {
+	const char *name;
+	void (*run)(void);
+} workload_t;
+
+static const workload_t workloads[] = {
+	{ "churn",		churn_workload },
+	{ "mixed",		mixed_workload },
+	{ "phases",		phases_workload },
+};
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void run_workload(const workload_t *pLoad, int policy)
+{
+	dallopt(DALLOC_OPT_TCACHE_COUNT, 0);
+	dallopt(DALLOC_OPT_SLAB, 0);
+	dallopt(DALLOC_OPT_ARENA_COUNT, 1);
+	dallopt(DALLOC_OPT_PLACEMENT, policy);
+
+	seed = 2463534242u;
+	pLat = malloc(LAT_MAX * sizeof(uint32_t));
+	// Fault it in before the clock starts (not with 0: malloc + memset 0 would become calloc)
+	memset(pLat, 0xff, LAT_MAX * sizeof(uint32_t));
+
+	reset_peak_rss();
+	size_t rss_start = status_kb("VmRSS:");
+	uint64_t t0 = now_ns();
+
+	pLoad->run();
+
+	double seconds = (now_ns() - t0) / 1e9;
+	size_t rss_peak = status_kb("VmHWM:");
+
+	// The heap as the steady phase left it
+	dalloc_stats_t stats;
+	dalloc_stats(&stats);
+
+	for (unsigned slot = 0; slot < SLOTS; ++slot)
+		if (pSlots[slot])
+			release(slot);
+
+	qsort(pLat, lat_count, sizeof(uint32_t), cmp_u32);
+
+	size_t rss_grow = rss_peak > rss_start ? rss_peak - rss_start : 0;
+	double frag = rss_grow > live_peak ? 1.0 - (double)live_peak / rss_grow : 0.0;
+
+	printf("%-8s %-10s %9.3f %8u %8u %8u %9.1f %6.1f%% %7zu %6.1f%%\n",
+		pLoad->name, policy_names[policy], ops / seconds / 1e6,
+		lat_count ? pLat[lat_count / 2] : 0, lat_count ? pLat[lat_count * 99 / 100] : 0,
+		lat_count ? pLat[lat_count * 999 / 1000] : 0,
+		rss_grow / (1024.0 * 1024.0), frag * 100.0, stats.free_blocks, stats.fragmentation * 100.0);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+		scale = atol(argv[1]);
+
+	if (scale < 1) {
+		fprintf(stderr, "usage: %s [scale >= 1]\n", argv[0]);
+		return 1;
+	}
+
+	printf("*** dalloc placement policies: scale %ld (no thread cache, no slabs) ***\n", scale);
+	printf("%-8s %-10s %9s %8s %8s %8s %9s %7s %7s %7s\n",
+		"workload", "policy", "Mops/s", "p50 ns", "p99 ns", "p999 ns", "rss MiB", "frag", "holes", "ext");
+
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); ++i)
+		for (int policy = DALLOC_PLACEMENT_GOOD_FIT; policy <= DALLOC_PLACEMENT_NEXT_FIT; ++policy) {
+			fflush(stdout);
+
+			pid_t pid = fork();
+			if (pid == 0) {
+				run_workload(&workloads[i], policy);
+				fflush(stdout);
+				_exit(0);
+			}
+
+			int status;
+			waitpid(pid, &status, 0);
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				printf("%-8s %-10s failed (status %d)\n", workloads[i].name, policy_names[policy], status);
+		}
+
+	return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * dalloc_preload.c
+ *
+ * Makes dalloc the malloc of any program, without recompiling it:
+ *
+ *     make libdalloc.so
+ *     LD_PRELOAD=./libdalloc.so ls -l
+ *
+ * The dynamic linker resolves symbols in the preloaded library first, so these
+ * functions replace the ones of the C library for the program and all of its
+ * libraries. Only the standard contract (errno, size 0, ...) is added here;
+ * the work is done by the d* functions.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "dalloc.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+EXPORT void *malloc(size_t size)
+{
+	// malloc(0) may return NULL or a unique pointer; programs expect the latter
+	void *ptr = dalloc(size ? size : 1);
+	if (!ptr)
+		errno = ENOMEM;
+	return ptr;
+}
+
+EXPORT void free(void *ptr)
+{
+	dfree(ptr);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+	void *ptr = (nmemb && size) ? dcalloc(nmemb, size) : dcalloc(1, 1);
+	if (!ptr)
+		errno = ENOMEM;
+	return ptr;
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+	if (!ptr)
+		return malloc(size);
+
+	if (size == 0) {
+		dfree(ptr);
+		return NULL;
+	}
+
+	void *pNew = drealloc(ptr, size);
+	if (!pNew)
+		errno = ENOMEM;
+	return pNew;
+}
+
+EXPORT void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	if (size && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(ptr, nmemb * size);
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	return dposix_memalign(memptr, alignment, size ? size : 1);
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+	void *ptr = daligned_alloc(alignment, size ? size : 1);
+	if (!ptr)
+		errno = (alignment && !(alignment & (alignment - 1))) ? ENOMEM : EINVAL;
+	return ptr;
+}
+
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+	void *ptr = dmemalign(alignment, size ? size : 1);
+	if (!ptr)
+		errno = ENOMEM;
+	return ptr;
+}
+
+EXPORT void *valloc(size_t size)
+{
+	void *ptr = dvalloc(size ? size : 1);
+	if (!ptr)
+		errno = ENOMEM;
+	return ptr;
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	return valloc((size + page - 1) & ~(page - 1));
+}
+
+/*
+ * C++ sized delete: operator delete(void *, std::size_t) and its array form.
+ * The default ones just call free(); the size lets dalloc skip the lookup.
+ * (Itanium C++ ABI names, as exported by libstdc++)
+ */
+EXPORT void _ZdlPvm(void *ptr, size_t size)
+{
+	dfree_sized(ptr, size);
+}
+
+EXPORT void _ZdaPvm(void *ptr, size_t size)
+{
+	dfree_sized(ptr, size);
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+	return dalloc_usable_size(ptr);
+}
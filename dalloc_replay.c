@@ -0,0 +1,448 @@
+/*
+ * dalloc_replay.c
+ *
+ * Plays back an allocation trace recorded with DALLOC_TRACE=<file> (or
+ * dalloc_trace_start()). The same source is built twice by 'make replay':
+ *   dalloc_replay      -> dalloc (compiled in, -O2)
+ *   dalloc_replay_sys  -> the system malloc (-DREPLAY_SYSTEM)
+ * so both see exactly the same calls, in the same order.
+ *
+ * Usage: ./dalloc_replay <trace>
+ *
+ * The replay is deterministic: one thread makes every call of the trace in the
+ * order of their timestamps. It measures the allocator on the real allocation
+ * pattern of a program, not the program's threading.
+ *
+ * The trace is first resolved into a list of operations on numbered slots (one
+ * per object alive at the same time), so the timed loop does no hashing, and
+ * the replayer's own memory comes from mmap(), outside both allocators.
+ *
+ * Reported:
+ *   time        : the whole replay and the average per call
+ *   peak live   : highest sum of the sizes requested and not freed yet
+ *   peak rss    : peak RSS growth during the replay
+ *   frag        : share of that RSS not holding live data (1 - peak live / rss)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The trace format is in dalloc.h, for both builds
+#include "dalloc.h"
+#include "dalloc_harness.h"
+
+#ifdef REPLAY_SYSTEM
+	#include <malloc.h>
+	#define ALLOC(size)					malloc(size)
+	#define CALLOC(size)				calloc(1, size)
+	#define ALIGNED(alignment, size)	memalign(alignment, size)
+	#define REALLOC(ptr, size)			realloc(ptr, size)
+	#define FREE(ptr)					free(ptr)
+	#define ALLOCATOR_NAME				"system malloc"
+#else
+	#define ALLOC(size)					dalloc(size)
+	#define CALLOC(size)				dcalloc(1, size)
+	#define ALIGNED(alignment, size)	dmemalign(alignment, size)
+	#define REALLOC(ptr, size)			drealloc(ptr, size)
+	#define FREE(ptr)					dfree(ptr)
+	#define ALLOCATOR_NAME				"dalloc"
+#endif
+
+#define NO_SLOT			UINT32_MAX	// The object was allocated before the trace started
+#define THREAD_COUNT	65536		// Thread numbers are 16 bits
+
+// One call to make, in replay order
+typedef struct {
+	uint64_t size;
+	uint64_t arg;			// Alignment of DALLOC_TRACE_ALIGNED, 1 for a DALLOC_TRACE_REALLOC_END that failed
+	uint32_t slot;			// Object allocated or freed (DALLOC_TRACE_REALLOC: the old one)
+	uint16_t thread;
+	uint8_t op;
+} replay_op_t;
+
+typedef struct {
+	void *ptr;
+	size_t size;
+} object_t;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Zero-filled memory outside the allocator under test
+static void *map_memory(size_t size)
+{
+	void *ptr = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED) {
+		fprintf(stderr, "replay: out of memory (%zu bytes)\n", size);
+		exit(1);
+	}
+	return ptr;
+}
+
+// ***********************************************************************
+// Loading: sort the records, then turn object ids into slots
+// ***********************************************************************
+
+static dalloc_trace_record_t *pRecords;
+static size_t record_count;
+
+// Reads the whole trace. Returns 0 if it is not a trace of this version
+static int load_trace(const char *path)
+{
+	dalloc_trace_header_t header;
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		perror(path);
+		return 0;
+	}
+
+	if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+		memcmp(header.magic, DALLOC_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version != DALLOC_TRACE_VERSION || header.record_size != sizeof(dalloc_trace_record_t)) {
+		fprintf(stderr, "%s: not a dalloc trace (version %d)\n", path, DALLOC_TRACE_VERSION);
+		close(fd);
+		return 0;
+	}
+
+	// A trace cut short by a crash ends in the middle of a record: that one is dropped
+	record_count = (st.st_size - sizeof(header)) / sizeof(dalloc_trace_record_t);
+	pRecords = map_memory(record_count * sizeof(dalloc_trace_record_t));
+
+	char *pData = (char *)pRecords;
+	size_t left = record_count * sizeof(dalloc_trace_record_t);
+	while (left) {
+		ssize_t got = read(fd, pData, left);
+		if (got <= 0) {
+			perror(path);
+			close(fd);
+			return 0;
+		}
+		pData += got;
+		left -= got;
+	}
+
+	close(fd);
+	return 1;
+}
+
+// By time, then by position in the file: a thread's records are already in order
+static int cmp_order(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	uint64_t tx = pRecords[x].time_ns, ty = pRecords[y].time_ns;
+
+	if (tx != ty)
+		return (tx > ty) - (tx < ty);
+	return (x > y) - (x < y);
+}
+
+// Object id -> slot, open addressing. Only used while loading, it grows as needed
+typedef struct {
+	uint64_t *pIds;		// 0: empty
+	uint32_t *pSlots;
+	size_t mask;
+	size_t count;
+} id_map_t;
+
+static inline size_t id_hash(uint64_t id, size_t mask)
+{
+	return (size_t)((id >> 4) * 0x9E3779B97F4A7C15ull >> 17) & mask;
+}
+
+static void id_map_init(id_map_t *pMap, size_t capacity)
+{
+	pMap->pIds = map_memory(capacity * sizeof(uint64_t));
+	pMap->pSlots = map_memory(capacity * sizeof(uint32_t));
+	pMap->mask = capacity - 1;
+	pMap->count = 0;
+}
+
+static void id_map_put(id_map_t *pMap, uint64_t id, uint32_t slot);
+
+static void id_map_grow(id_map_t *pMap)
+{
+	id_map_t old = *pMap;
+
+	id_map_init(pMap, (old.mask + 1) * 2);
+	for (size_t i = 0; i <= old.mask; ++i)
+		if (old.pIds[i])
+			id_map_put(pMap, old.pIds[i], old.pSlots[i]);
+
+	munmap(old.pIds, (old.mask + 1) * sizeof(uint64_t));
+	munmap(old.pSlots, (old.mask + 1) * sizeof(uint32_t));
+}
+
+static void id_map_put(id_map_t *pMap, uint64_t id, uint32_t slot)
+{
+	if ((pMap->count + 1) * 2 > pMap->mask + 1)
+		id_map_grow(pMap);
+
+	size_t i = id_hash(id, pMap->mask);
+	while (pMap->pIds[i] && pMap->pIds[i] != id)
+		i = (i + 1) & pMap->mask;
+
+	// An address allocated twice without a free in between: the first object was
+	// allocated before the trace started and freed by a call the trace missed
+	if (!pMap->pIds[i])
+		pMap->count++;
+
+	pMap->pIds[i] = id;
+	pMap->pSlots[i] = slot;
+}
+
+// Removes the id, returns its slot (NO_SLOT if unknown)
+static uint32_t id_map_take(id_map_t *pMap, uint64_t id)
+{
+	size_t i = id_hash(id, pMap->mask);
+
+	while (pMap->pIds[i] != id) {
+		if (!pMap->pIds[i])
+			return NO_SLOT;
+		i = (i + 1) & pMap->mask;
+	}
+
+	uint32_t slot = pMap->pSlots[i];
+
+	// Backward shift: move up the entries that probed past the hole
+	for (size_t j = (i + 1) & pMap->mask; pMap->pIds[j]; j = (j + 1) & pMap->mask) {
+		size_t home = id_hash(pMap->pIds[j], pMap->mask);
+		if (((j - home) & pMap->mask) >= ((j - i) & pMap->mask)) {
+			pMap->pIds[i] = pMap->pIds[j];
+			pMap->pSlots[i] = pMap->pSlots[j];
+			i = j;
+		}
+	}
+
+	pMap->pIds[i] = 0;
+	pMap->count--;
+	return slot;
+}
+
+static replay_op_t *pOps;
+static size_t op_count;
+static size_t slot_count;		// Most objects alive at the same time
+static size_t unknown_frees;	// Frees of objects allocated before the trace started
+
+// Slot numbers are reused, so there are only as many as objects alive at once
+static uint32_t *pFreeSlots;
+static size_t free_slot_count;
+
+static inline uint32_t slot_new(void)
+{
+	return free_slot_count ? pFreeSlots[--free_slot_count] : (uint32_t)slot_count++;
+}
+
+static void resolve_trace(void)
+{
+	uint32_t *pOrder = map_memory(record_count * sizeof(uint32_t));
+	for (size_t i = 0; i < record_count; ++i)
+		pOrder[i] = i;
+	qsort(pOrder, record_count, sizeof(uint32_t), cmp_order);
+
+	pOps = map_memory(record_count * sizeof(replay_op_t));
+	pFreeSlots = map_memory(record_count * sizeof(uint32_t));
+
+	// Id of the block each thread's drealloc started with, until it returns
+	uint64_t *pPendingIds = map_memory(THREAD_COUNT * sizeof(uint64_t));
+
+	id_map_t map;
+	id_map_init(&map, 1 << 16);
+
+	for (size_t i = 0; i < record_count; ++i) {
+		const dalloc_trace_record_t *pRecord = &pRecords[pOrder[i]];
+		replay_op_t op = { pRecord->size, pRecord->arg, NO_SLOT, pRecord->thread, pRecord->op };
+		uint32_t slot;
+
+		switch (pRecord->op) {
+		case DALLOC_TRACE_ALLOC:
+		case DALLOC_TRACE_CALLOC:
+		case DALLOC_TRACE_ALIGNED:
+			op.slot = slot_new();
+			id_map_put(&map, pRecord->id, op.slot);
+			break;
+
+		case DALLOC_TRACE_FREE:
+			if ((op.slot = id_map_take(&map, pRecord->id)) == NO_SLOT) {
+				unknown_frees++;
+				continue;
+			}
+			pFreeSlots[free_slot_count++] = op.slot;
+			break;
+
+		// The old block leaves its slot: the replay keeps it aside, per thread, until the end record
+		case DALLOC_TRACE_REALLOC:
+			pPendingIds[op.thread] = pRecord->id;
+			if (pRecord->id && (slot = id_map_take(&map, pRecord->id)) != NO_SLOT) {
+				op.slot = slot;
+				pFreeSlots[free_slot_count++] = slot;
+			} else if (pRecord->id) {
+				unknown_frees++;
+			}
+			break;
+
+		// The new block (or the old one, if drealloc failed) gets a slot
+		case DALLOC_TRACE_REALLOC_END: {
+			uint64_t id = pRecord->id;
+			if (!id && pRecord->size) {
+				id = pPendingIds[op.thread];
+				op.arg = 1;
+			}
+			if (id) {
+				op.slot = slot_new();
+				id_map_put(&map, id, op.slot);
+			}
+			break;
+		}
+
+		default:
+			continue;
+		}
+
+		pOps[op_count++] = op;
+	}
+
+	munmap(map.pIds, (map.mask + 1) * sizeof(uint64_t));
+	munmap(map.pSlots, (map.mask + 1) * sizeof(uint32_t));
+	munmap(pPendingIds, THREAD_COUNT * sizeof(uint64_t));
+	munmap(pFreeSlots, record_count * sizeof(uint32_t));
+	munmap(pOrder, record_count * sizeof(uint32_t));
+	munmap(pRecords, record_count * sizeof(dalloc_trace_record_t));
+}
+
+// ***********************************************************************
+// Replay
+// ***********************************************************************
+
+static size_t live, live_peak;
+static size_t calls;
+
+// Touch every page, as the program did: RSS then shows what the allocator really costs
+static inline void touch(void *ptr, size_t from, size_t size)
+{
+	for (size_t i = from; i < size; i += 4096)
+		((volatile char *)ptr)[i] = 1;
+}
+
+static void replay(object_t *pSlots, object_t *pPending)
+{
+	for (size_t i = 0; i < op_count; ++i) {
+		const replay_op_t *pOp = &pOps[i];
+		object_t *pObject = pOp->slot != NO_SLOT ? &pSlots[pOp->slot] : NULL;
+		object_t *pOld = &pPending[pOp->thread];
+		void *ptr;
+
+		switch (pOp->op) {
+		case DALLOC_TRACE_ALLOC:
+		case DALLOC_TRACE_CALLOC:
+		case DALLOC_TRACE_ALIGNED:
+			if (pOp->op == DALLOC_TRACE_ALLOC)
+				ptr = ALLOC(pOp->size);
+			else if (pOp->op == DALLOC_TRACE_CALLOC)
+				ptr = CALLOC(pOp->size);
+			else
+				ptr = ALIGNED(pOp->arg, pOp->size);
+
+			if (!ptr) {
+				fprintf(stderr, "replay: out of memory (%zu bytes)\n", (size_t)pOp->size);
+				exit(1);
+			}
+
+			touch(ptr, 0, pOp->size);
+			*pObject = (object_t){ ptr, pOp->size };
+			live += pOp->size;
+			calls++;
+			break;
+
+		case DALLOC_TRACE_FREE:
+			FREE(pObject->ptr);
+			live -= pObject->size;
+			calls++;
+			break;
+
+		case DALLOC_TRACE_REALLOC:
+			*pOld = pObject ? *pObject : (object_t){ NULL, 0 };
+			break;
+
+		case DALLOC_TRACE_REALLOC_END:
+			// The recorded drealloc failed: the program kept the old block
+			if (pOp->arg) {
+				if (pObject)
+					*pObject = *pOld;
+				break;
+			}
+
+			ptr = REALLOC(pOld->ptr, pOp->size);
+			calls++;
+			live -= pOld->size;
+
+			if (pOp->size && !ptr) {
+				fprintf(stderr, "replay: out of memory (%zu bytes)\n", (size_t)pOp->size);
+				exit(1);
+			}
+
+			if (pObject) {
+				touch(ptr, pOld->size, pOp->size);
+				*pObject = (object_t){ ptr, pOp->size };
+				live += pOp->size;
+			}
+			break;
+		}
+
+		if (live > live_peak)
+			live_peak = live;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <trace>\n", argv[0]);
+		return 1;
+	}
+
+	if (!load_trace(argv[1]))
+		return 1;
+
+	size_t record_total = record_count;
+	resolve_trace();
+
+	// Fault the replayer's memory in before the measurement starts
+	object_t *pSlots = map_memory(slot_count * sizeof(object_t));
+	object_t *pPending = map_memory(THREAD_COUNT * sizeof(object_t));
+	memset(pSlots, 0, slot_count * sizeof(object_t));
+	memset(pPending, 0, THREAD_COUNT * sizeof(object_t));
+
+	reset_peak_rss();
+	size_t rss_start = status_kb("VmRSS:");
+	uint64_t t0 = now_ns();
+
+	replay(pSlots, pPending);
+
+	double seconds = (now_ns() - t0) / 1e9;
+	size_t rss_peak = status_kb("VmHWM:");
+	size_t rss_grow = rss_peak > rss_start ? rss_peak - rss_start : 0;
+	double frag = rss_grow > live_peak ? 1.0 - (double)live_peak / rss_grow : 0.0;
+
+	printf("*** %s: %s ***\n", ALLOCATOR_NAME, argv[1]);
+	printf("records:      %zu (%zu calls replayed, %zu frees of older blocks skipped)\n",
+		record_total, calls, unknown_frees);
+	printf("time:         %.3f ms, %.1f ns per call\n", seconds * 1e3, calls ? seconds * 1e9 / calls : 0.0);
+	printf("peak live:    %.1f MiB\n", live_peak / (1024.0 * 1024.0));
+	printf("peak rss:     %.1f MiB\n", rss_grow / (1024.0 * 1024.0));
+	printf("frag:         %.1f%%\n", frag * 100.0);
+
+	return 0;
+}
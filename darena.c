@@ -0,0 +1,149 @@
+#include <stdint.h>
+#include "dalloc.h"
+#include "darena.h"
+
+/*
+ * Layout: a list of chunks, each one a dalloc block that starts with a small
+ * header. Only the current chunk is bumped; the cursor never goes back until
+ * darena_reset().
+ *
+ *   pChunks -> | hdr | used ......... | -> | hdr | used ...  free | -> | hdr | (kept) |
+ *                                                  ^pCursor     ^pLimit
+ *
+ * A request bigger than a quarter of a chunk gets a chunk of its own (pLarge),
+ * so it does not throw away the free end of the current chunk.
+ */
+#define DARENA_ALIGNMENT	16
+#define DARENA_CHUNK_SIZE	(64 * 1024)
+#define DARENA_MIN_CHUNK	256
+
+#define ALIGN_UP(value, alignment) (((value) + ((alignment) - 1)) & ~((uintptr_t)(alignment) - 1))
+
+typedef struct darena_chunk {
+	struct darena_chunk *pNext;
+	char *pEnd;		// End of the chunk's memory
+} darena_chunk_t;
+
+struct darena {
+	char *pCursor;				// Next free byte of the current chunk
+	char *pLimit;				// End of the current chunk
+	darena_chunk_t *pCurrent;
+	darena_chunk_t *pChunks;	// Regular chunks in the order they are used, kept by darena_reset()
+	darena_chunk_t *pLarge;		// Chunks of single large allocations, freed by darena_reset()
+	size_t chunk_size;
+};
+
+darena_t *darena_create(size_t chunk_size)
+{
+	if (chunk_size == 0)
+		chunk_size = DARENA_CHUNK_SIZE;
+	if (chunk_size < DARENA_MIN_CHUNK)
+		chunk_size = DARENA_MIN_CHUNK;
+	if (chunk_size > SIZE_MAX / 4)
+		return NULL;
+
+	darena_t *pArena = dcalloc(1, sizeof(darena_t));
+	if (pArena)
+		pArena->chunk_size = ALIGN_UP(chunk_size, DARENA_ALIGNMENT);
+
+	return pArena;
+}
+
+// The current chunk is full: a chunk of its own for a large request, the next regular chunk otherwise
+static void *darena_alloc_slow(darena_t *pArena, size_t alignment, size_t size)
+{
+	// Worst case: 'alignment - 1' bytes of padding in front
+	size_t need = size + alignment;
+
+	if (need > pArena->chunk_size / 4) {
+		darena_chunk_t *pChunk = dalloc(sizeof(darena_chunk_t) + need);
+		if (!pChunk)
+			return NULL;
+
+		pChunk->pNext = pArena->pLarge;
+		pChunk->pEnd = (char *)(pChunk + 1) + need;
+		pArena->pLarge = pChunk;
+
+		return (void *)ALIGN_UP((uintptr_t)(pChunk + 1), alignment);
+	}
+
+	// Reuse the chunk a reset left behind, or take a new one
+	darena_chunk_t *pNext = pArena->pCurrent ? pArena->pCurrent->pNext : pArena->pChunks;
+
+	if (!pNext) {
+		if (!(pNext = dalloc(pArena->chunk_size)))
+			return NULL;
+
+		pNext->pNext = NULL;
+		pNext->pEnd = (char *)pNext + pArena->chunk_size;
+
+		if (pArena->pCurrent)
+			pArena->pCurrent->pNext = pNext;
+		else
+			pArena->pChunks = pNext;
+	}
+
+	pArena->pCurrent = pNext;
+	pArena->pLimit = pNext->pEnd;
+
+	// A regular chunk is at least 4 times 'need', it always fits
+	char *pResult = (char *)ALIGN_UP((uintptr_t)(pNext + 1), alignment);
+	pArena->pCursor = pResult + size;
+
+	return pResult;
+}
+
+void *darena_alloc_aligned(darena_t *pArena, size_t alignment, size_t size)
+{
+	if (size == 0 || size > SIZE_MAX / 2)
+		return NULL;
+	if (!alignment || (alignment & (alignment - 1)) || alignment > SIZE_MAX / 4)
+		return NULL;
+	if (alignment < DARENA_ALIGNMENT)
+		alignment = DARENA_ALIGNMENT;
+
+	// Fast path: move the cursor
+	char *pResult = (char *)ALIGN_UP((uintptr_t)pArena->pCursor, alignment);
+
+	if (pResult <= pArena->pLimit && size <= (size_t)(pArena->pLimit - pResult)) {
+		pArena->pCursor = pResult + size;
+		return pResult;
+	}
+
+	return darena_alloc_slow(pArena, alignment, size);
+}
+
+void *darena_alloc(darena_t *pArena, size_t size)
+{
+	return darena_alloc_aligned(pArena, DARENA_ALIGNMENT, size);
+}
+
+static void free_chunks(darena_chunk_t *pChunk)
+{
+	while (pChunk) {
+		darena_chunk_t *pNext = pChunk->pNext;
+		dfree(pChunk);
+		pChunk = pNext;
+	}
+}
+
+void darena_reset(darena_t *pArena)
+{
+	free_chunks(pArena->pLarge);
+	pArena->pLarge = NULL;
+
+	// Start again from the first regular chunk (the next allocation takes it)
+	pArena->pCurrent = NULL;
+	pArena->pCursor = NULL;
+	pArena->pLimit = NULL;
+}
+
+void darena_destroy(darena_t *pArena)
+{
+	if (!pArena)
+		return;
+
+	free_chunks(pArena->pLarge);
+	free_chunks(pArena->pChunks);
+	dfree(pArena);
+}
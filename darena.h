@@ -0,0 +1,55 @@
+#ifndef DARENA_H
+#define DARENA_H
+
+#include <stddef.h>
+
+/**
+ * @brief Region (bump) allocator on top of dalloc (Depones Arena).
+ *
+ * Memory is handed out by moving a cursor forward inside large chunks taken
+ * from dalloc. Nothing is freed one by one: darena_reset() or darena_destroy()
+ * release everything allocated from the region at once.
+ * Made for request-scoped memory: allocate freely while handling a request,
+ * reset when it is done.
+ *
+ * @note A region is not thread-safe, use one region per thread (or lock it).
+ */
+typedef struct darena darena_t;
+
+/**
+ * @brief Creates an empty region.
+ *
+ * @param chunk_size  Size of the chunks taken from dalloc (0: 64 KiB).
+ * @return darena_t*  The region, or NULL if there is no memory.
+ */
+darena_t *darena_create(size_t chunk_size);
+
+/**
+ * @brief Allocates 'size' bytes, 16-byte aligned.
+ *
+ * @return void*  The memory, or NULL if 'size' is 0 or there is no memory.
+ */
+void *darena_alloc(darena_t *pArena, size_t size);
+
+/**
+ * @brief Allocates 'size' bytes aligned to 'alignment' (a power of two).
+ *
+ * @return void*  The memory, or NULL if the alignment is invalid or there is no memory.
+ */
+void *darena_alloc_aligned(darena_t *pArena, size_t alignment, size_t size);
+
+/**
+ * @brief Releases everything allocated from the region in one step.
+ *
+ * The chunks are kept and reused by the next allocations, so a region that is
+ * reset after every request stops calling dalloc once it is warm.
+ * Chunks of single large allocations are given back to dalloc.
+ */
+void darena_reset(darena_t *pArena);
+
+/**
+ * @brief Releases the region and all of its memory.
+ */
+void darena_destroy(darena_t *pArena);
+
+#endif // DARENA_H
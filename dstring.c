@@ -1,35 +1,193 @@
-#include <stdio.h>
-#include "string.h"
+#include <stdint.h>
+#include <string.h>
+#include "dstring.h"
+#include "dalloc.h"
 
-// Depones Safe String Copy
-// Returns the total length of the 'src' file. 
-// If the returned value is >= size, it means a truncation has occurred.
+// -DDSTRING_NO_SIMD: only the portable word-at-a-time scan
+#if defined(__SSE2__) && !defined(DSTRING_NO_SIMD)
+    #include <emmintrin.h>
+    #define DSTR_HAVE_SSE2
+
+    #if defined(__x86_64__) && defined(__GNUC__)
+        #include <immintrin.h>
+        #define DSTR_HAVE_AVX2
+    #endif
+#endif
+
+// ***********************************************************************
+// Length Scan (the NUL byte search behind every function here)
+// ***********************************************************************
 
-size_t dstrncpy(char *dst, const char *src, size_t size) 
+/*
+ * Looking at one byte per iteration is what made dstrncpy() slow: the scans
+ * below test a whole word (8 bytes), SSE2 register (16) or AVX2 register (32)
+ * per step.
+ *
+ * They may read past the NUL byte (and past 'max'), but only inside the aligned
+ * block holding it: an aligned load never crosses a page boundary, so it can
+ * never touch an unmapped page the string does not reach. The bytes before the
+ * start of the string in the first block are masked off. AddressSanitizer does
+ * not know that, hence the attribute.
+ */
+#if defined(__GNUC__)
+    #define DSTR_SCAN __attribute__((no_sanitize_address))
+#else
+    #define DSTR_SCAN
+#endif
+
+#ifndef DSTR_HAVE_SSE2
+// Word-at-a-time: (w - 0x01..01) & ~w & 0x80..80 is non-zero iff a byte of w is 0
+#define ONES        ((uintptr_t)-1 / 0xFF)
+#define HIGHS       (ONES * 0x80)
+#define HAS_ZERO(w) (((w) - ONES) & ~(w) & HIGHS)
+
+// Returns strnlen(s, max)
+static DSTR_SCAN size_t length_word(const char *s, size_t max)
 {
-    const char *src_start = src;
-    size_t left = size;
+    const char *p = s;
 
-    // Copy if there is space in the target buffer
-    if (left > 0) {
-        // Subtract 1 to reserve space for NULL character (\0)
-        while (--left != 0) {
-            if ((*dst++ = *src++) == '\0') {
-                // If the `src` (short string) ends, it's done
-                // The `dst` already ends with `\0`
-                return (src - src_start - 1); 
-            }
+    // Up to the first aligned word, one byte at a time
+    for (; (uintptr_t)p % sizeof(uintptr_t); ++p) {
+        if ((size_t)(p - s) >= max)
+            return max;
+        if (!*p)
+            return p - s;
+    }
+
+    for (; (size_t)(p - s) < max; p += sizeof(uintptr_t)) {
+        uintptr_t word;
+        memcpy(&word, p, sizeof(word)); // A single aligned load, without breaking aliasing rules
+        if (HAS_ZERO(word))
+            break;
+    }
+
+    // The NUL byte is in this word (or 'max' was reached)
+    for (; (size_t)(p - s) < max && *p; ++p)
+        ;
+
+    return (size_t)(p - s) < max ? (size_t)(p - s) : max;
+}
+#endif
+
+#ifdef DSTR_HAVE_SSE2
+static DSTR_SCAN size_t length_sse2(const char *s, size_t max)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)15);
+
+    // dstrndup(s, 0): 's' may point past the end of the buffer
+    if (max == 0)
+        return 0;
+
+    // One bit per byte that is 0, without the bytes before 's'
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)p), zero));
+    mask >>= s - p;
+
+    while (!mask) {
+        p += 16;
+        if ((size_t)(p - s) >= max)
+            return max;
+
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)p), zero));
+        if (mask) {
+            size_t length = (p - s) + __builtin_ctz(mask);
+            return length < max ? length : max;
+        }
+    }
+
+    return (size_t)__builtin_ctz(mask) < max ? (size_t)__builtin_ctz(mask) : max;
+}
+#endif
+
+#ifdef DSTR_HAVE_AVX2
+static DSTR_SCAN __attribute__((target("avx2"))) size_t length_avx2(const char *s, size_t max)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)31);
+
+    if (max == 0)
+        return 0;
+
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)p), zero));
+    mask >>= s - p;
+
+    while (!mask) {
+        p += 32;
+        if ((size_t)(p - s) >= max)
+            return max;
+
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)p), zero));
+        if (mask) {
+            size_t length = (p - s) + __builtin_ctz(mask);
+            return length < max ? length : max;
         }
     }
 
-    // If the buffer is full but the src hasn't completed
+    return (size_t)__builtin_ctz(mask) < max ? (size_t)__builtin_ctz(mask) : max;
+}
+
+// The first call picks the widest scan the CPU has (the race between threads is harmless)
+static size_t length_resolve(const char *s, size_t max);
+static size_t (*string_length)(const char *, size_t) = length_resolve;
+
+static size_t length_resolve(const char *s, size_t max)
+{
+    __builtin_cpu_init();
+    string_length = __builtin_cpu_supports("avx2") ? length_avx2 : length_sse2;
+
+    return string_length(s, max);
+}
+#elif defined(DSTR_HAVE_SSE2)
+    #define string_length length_sse2
+#else
+    #define string_length length_word
+#endif
+
+// ***********************************************************************
+// Public API
+// ***********************************************************************
+
+// Depones Safe String Copy
+// Returns the total length of the 'src' file.
+// If the returned value is >= size, it means a truncation has occurred.
+
+size_t dstrncpy(char *dst, const char *src, size_t size)
+{
+    // The whole length is returned anyway: find it once, then copy in bulk
+    size_t length = string_length(src, SIZE_MAX);
+
     if (size > 0) {
-        *dst = '\0'; // Always use null-terminate!
+        // Subtract 1 to reserve space for NULL character (\0)
+        size_t n = length < size - 1 ? length : size - 1;
+
+        memcpy(dst, src, n);
+        dst[n] = '\0'; // Always use null-terminate!
     }
 
-    // Calculate the length of the rest of the src (for truncation check)
-    while (*src++)
-        ;
+    return length;
+}
+
+char *dstrdup(const char *src)
+{
+    size_t length = string_length(src, SIZE_MAX);
+    char *pCopy = dalloc(length + 1);
+
+    // The NUL byte comes along
+    if (pCopy)
+        memcpy(pCopy, src, length + 1);
+
+    return pCopy;
+}
+
+char *dstrndup(const char *src, size_t n)
+{
+    size_t length = string_length(src, n);
+    char *pCopy = dalloc(length + 1);
+
+    if (pCopy) {
+        memcpy(pCopy, src, length);
+        pCopy[length] = '\0';
+    }
 
-    return (src - src_start - 1);
+    return pCopy;
 }
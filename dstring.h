@@ -16,7 +16,32 @@
  * If the return value is >= size, truncation occurred.
  *
  * @note This function does not handle overlapping buffers.
+ * @note The source is scanned once, a word or a SIMD register at a time, then
+ * copied with memcpy.
  */
 size_t dstrncpy(char *dst, const char *src, size_t size);
 
+/**
+ * @brief Duplicates a string into memory from dalloc.
+ *
+ * The length is computed once and the exact size (length + 1) is allocated
+ * with a single dalloc() call.
+ *
+ * @param src   Source string.
+ * @return char* The copy (release it with dfree()), or NULL if memory ran out.
+ */
+char *dstrdup(const char *src);
+
+/**
+ * @brief Duplicates at most n characters of a string into memory from dalloc.
+ *
+ * The copy is always null-terminated. The scan stops after n characters,
+ * so src does not need a terminator within them.
+ *
+ * @param src   Source string.
+ * @param n     Maximum number of characters to copy.
+ * @return char* The copy (release it with dfree()), or NULL if memory ran out.
+ */
+char *dstrndup(const char *src, size_t n);
+
 #endif // DSTRING_H
@@ -0,0 +1,217 @@
+/*
+ * dstring_bench.c
+ *
+ * dstrncpy() against the byte-at-a-time version it replaced, and dstrdup()
+ * against the strlen + dalloc + copy it saves the callers.
+ *
+ * Usage: ./dstring_bench [scale]     (or: make strbench STRBENCH_ARGS=<scale>)
+ *
+ * It first checks that both versions give the same results, for every length
+ * and buffer size up to a few hundred bytes and every alignment, on strings
+ * that end right before an unmapped page: a scan reading past the page would
+ * crash here. dstrndup() is checked on strings without a terminator there.
+ *
+ * Reported per source length (copied into a 128-byte buffer, like a log line):
+ *   old / new ns    : time of one call
+ *   speedup         : old / new
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "dalloc.h"
+#include "dstring.h"
+
+#define DST_SIZE		128			// Destination buffer of the timed copies
+#define CHECK_MAX		300			// Lengths and sizes checked
+#define ITERATIONS		2000000		// Timed calls per length (divided by the length / 16 for the long ones)
+
+static long scale = 1;
+static volatile size_t sink;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// The version before the word-at-a-time / SIMD scan, kept as the reference
+static __attribute__((noinline)) size_t dstrncpy_bytewise(char *dst, const char *src, size_t size)
+{
+	const char *src_start = src;
+	size_t left = size;
+
+	if (left > 0) {
+		while (--left != 0) {
+			if ((*dst++ = *src++) == '\0')
+				return (src - src_start - 1);
+		}
+	}
+
+	if (size > 0)
+		*dst = '\0';
+
+	while (*src++)
+		;
+
+	return (src - src_start - 1);
+}
+
+// What callers did without dstrdup(): one scan for the length, one more in the copy
+static __attribute__((noinline)) char *dstrdup_bytewise(const char *src)
+{
+	size_t length = strlen(src);
+	char *pCopy = dalloc(length + 1);
+
+	if (pCopy)
+		dstrncpy_bytewise(pCopy, src, length + 1);
+
+	return pCopy;
+}
+
+static void fail(const char *pWhat, size_t length, size_t size)
+{
+	fprintf(stderr, "dstring_bench: %s differs (length %zu, size %zu)\n", pWhat, length, size);
+	exit(1);
+}
+
+// ***********************************************************************
+// Checks
+// ***********************************************************************
+
+static void check(void)
+{
+	long page = sysconf(_SC_PAGESIZE);
+
+	// A readable page followed by an unmapped one: the strings end at the boundary
+	char *pPage = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pPage == MAP_FAILED || mprotect(pPage + page, page, PROT_NONE) != 0) {
+		perror("dstring_bench: mmap");
+		exit(1);
+	}
+
+	char *pEnd = pPage + page;
+	char dst_old[CHECK_MAX + 16], dst_new[CHECK_MAX + 16];
+
+	for (size_t length = 0; length < CHECK_MAX; ++length) {
+		// Every alignment comes up: the start moves by one byte with each length
+		char *pSrc = pEnd - length - 1;
+		for (size_t i = 0; i < length; ++i)
+			pSrc[i] = 'a' + (i % 26);
+		pSrc[length] = '\0';
+
+		for (size_t size = 0; size < CHECK_MAX; ++size) {
+			memset(dst_old, 0x55, sizeof(dst_old));
+			memset(dst_new, 0x55, sizeof(dst_new));
+
+			if (dstrncpy_bytewise(dst_old, pSrc, size) != dstrncpy(dst_new, pSrc, size))
+				fail("dstrncpy length", length, size);
+			if (memcmp(dst_old, dst_new, sizeof(dst_old)) != 0)
+				fail("dstrncpy copy", length, size);
+		}
+
+		char *pDup = dstrdup(pSrc);
+		if (!pDup || strcmp(pDup, pSrc) != 0)
+			fail("dstrdup", length, 0);
+		dfree(pDup);
+
+		// Without the terminator: the last character is the last byte of the page
+		pSrc = pEnd - length;
+		memmove(pSrc, pSrc - 1, length);
+
+		for (size_t n = 0; n <= length; ++n) {
+			pDup = dstrndup(pSrc, n);
+			if (!pDup || strlen(pDup) != n || memcmp(pDup, pSrc, n) != 0)
+				fail("dstrndup", length, n);
+			dfree(pDup);
+		}
+
+		// A terminator before n
+		if (length > 0) {
+			pSrc[length / 2] = '\0';
+			pDup = dstrndup(pSrc, length);
+			if (!pDup || strcmp(pDup, pSrc) != 0)
+				fail("dstrndup (short)", length, length);
+			dfree(pDup);
+		}
+	}
+
+	munmap(pPage, 2 * page);
+	printf("checks: dstrncpy, dstrdup and dstrndup match for lengths and sizes 0..%d\n", CHECK_MAX - 1);
+}
+
+// ***********************************************************************
+// Timing
+// ***********************************************************************
+
+static double time_copy(size_t (*copy)(char *, const char *, size_t), const char *pSrc, long iterations)
+{
+	char dst[DST_SIZE];
+	uint64_t t0 = now_ns();
+
+	for (long i = 0; i < iterations; ++i)
+		sink += copy(dst, pSrc, sizeof(dst));
+
+	return (double)(now_ns() - t0) / iterations;
+}
+
+static double time_dup(char *(*dup)(const char *), const char *pSrc, long iterations)
+{
+	uint64_t t0 = now_ns();
+
+	for (long i = 0; i < iterations; ++i) {
+		char *pCopy = dup(pSrc);
+		sink += pCopy[0];
+		dfree(pCopy);
+	}
+
+	return (double)(now_ns() - t0) / iterations;
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t lengths[] = { 8, 16, 32, 64, 127, 256, 1024, 4096 };
+
+	if (argc > 1)
+		scale = atol(argv[1]);
+
+	if (scale < 1) {
+		fprintf(stderr, "usage: %s [scale >= 1]\n", argv[0]);
+		return 1;
+	}
+
+	check();
+
+	printf("\n*** dstring: scale %ld, %d-byte destination ***\n", scale, DST_SIZE);
+	printf("%-8s %12s %12s %8s %12s %12s %8s\n",
+		"length", "dstrncpy old", "new ns", "speedup", "dup old ns", "new ns", "speedup");
+
+	for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i) {
+		size_t length = lengths[i];
+		long iterations = ITERATIONS * scale / (length > 64 ? length / 16 : 4);
+
+		// Misaligned on purpose, as strings inside records usually are
+		char *pBuffer = dalloc(length + 2);
+		char *pSrc = pBuffer + 1;
+		memset(pSrc, 'x', length);
+		pSrc[length] = '\0';
+
+		double copy_old = time_copy(dstrncpy_bytewise, pSrc, iterations);
+		double copy_new = time_copy(dstrncpy, pSrc, iterations);
+		double dup_old = time_dup(dstrdup_bytewise, pSrc, iterations);
+		double dup_new = time_dup(dstrdup, pSrc, iterations);
+
+		printf("%-8zu %12.1f %12.1f %7.1fx %12.1f %12.1f %7.1fx\n", length,
+			copy_old, copy_new, copy_old / copy_new, dup_old, dup_new, dup_old / dup_new);
+
+		dfree(pBuffer);
+	}
+
+	return 0;
+}
@@ -1,11 +1,14 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "dalloc.h"
 #include "dstring.h"
 
 void attack_1_fail();
 void attack_2_success();
+void attack_3_guarded();
 
 // ***********************************************************************
 // Vulnerable Function (Unsafe dcalloc)
@@ -42,6 +45,7 @@ int main()
 
 	attack_1_fail();
 	attack_2_success();
+	attack_3_guarded();
 
     return 0;
 }
@@ -174,3 +178,39 @@ void attack_2_success()
     dfree(pAdminPanel);
     dfree(pHackerBuffer);
 }
+
+// ---------------------------------------------------------
+// SCENARIO 3: SAME ATTACK, SAMPLED GUARD PAGES
+// Logic: With DALLOC_OPT_GUARD_RATE, sampled blocks end right at a PROT_NONE page.
+// The first byte past the hacker's buffer faults, before it reaches any victim.
+// Rate 1 samples every allocation; in production 1 in thousands is enough to catch it eventually.
+// It runs in a child process, since the fault kills it.
+// ---------------------------------------------------------
+void attack_3_guarded()
+{
+    printf("\n\n*** SCENARIO 3: SAME ATTACK WITH GUARDED SAMPLING ***\n");
+    printf("Explanation: The hacker buffer is sampled into a page followed by a guard page.\n");
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dallopt(DALLOC_OPT_GUARD_RATE, 1);
+
+        int *pHackerBuffer = dcalloc_unsafe(4, 8);
+        UserConfig *pAdminPanel = dalloc(sizeof(UserConfig));
+        pAdminPanel->isAdmin = 0;
+        fflush(stdout);
+
+        for (int i = 0; i < 50; i++)
+            pHackerBuffer[i] = 0xDEADBEEF;
+
+        printf("Hacked! The overflow was not detected.\n");
+        _exit(0);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+
+    if (WIFSIGNALED(status))
+        printf("\nAttack stopped: the guard page killed the process (signal %d) at the first byte out of bounds.\n", WTERMSIG(status));
+}
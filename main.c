@@ -1,9 +1,19 @@
 #include <stdio.h>
 #include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "dalloc.h"
+#include "darena.h"
 
 int main()
 {
+	// The stages below watch how the shared heap reuses, merges and splits blocks.
+	// Turn the per-thread cache off, otherwise freed small blocks would wait there instead,
+	// and the slabs, otherwise small blocks would not come from the heap at all.
+	dallopt(DALLOC_OPT_TCACHE_COUNT, 0);
+	dallopt(DALLOC_OPT_SLAB, 0);
+
 	// *******************************************************************
     // Stage 1: Basic Allocation
     // *******************************************************************
@@ -182,5 +192,355 @@ int main()
     else
         printf("Allocated from a different space.\n");
 
+    printf("\n");
+    // *******************************************************************
+    // v3.0: Aligned Allocation
+    // *******************************************************************
+    printf("--- dalloc v3: Aligned Allocation Test ---\n");
+
+    // [TEST 1] Cache-line aligned block
+    printf("\n[TEST 1] daligned_alloc(64, 100)\n");
+    void *pLine = daligned_alloc(64, 100);
+    printf("pLine: %p\n", pLine);
+
+    if (((unsigned long)pLine & 63) == 0) printf("pLine is 64-byte aligned.\n");
+    else printf("pLine is not aligned!\n");
+
+    // [TEST 2] Page aligned block (O_DIRECT style buffer)
+    printf("\n[TEST 2] dposix_memalign(4096, 1000)\n");
+    void *pPage = NULL;
+    int err = dposix_memalign(&pPage, 4096, 1000);
+    printf("pPage: %p (Error: %d)\n", pPage, err);
+
+    if (err == 0 && ((unsigned long)pPage & 4095) == 0) printf("pPage is 4096-byte aligned.\n");
+    else printf("pPage is not aligned!\n");
+
+    // Both are released with the plain dfree()
+    dfree(pLine);
+    dfree(pPage);
+    printf("Aligned blocks freed with dfree().\n");
+
+    printf("\n");
+    // *******************************************************************
+    // v3.0: Batch Allocation
+    // *******************************************************************
+    printf("--- dalloc v3: Batch Allocation Test ---\n");
+
+    // 100 nodes of 40 bytes with one call: they are cut from one region, back to back
+    void *pNodes[100];
+    size_t got = dalloc_batch(40, 100, pNodes);
+    printf("Allocated %zu nodes, first: %p, last: %p\n", got, pNodes[0], pNodes[99]);
+
+    if (got == 100 && (char *)pNodes[99] - (char *)pNodes[0] == 99 * ((char *)pNodes[1] - (char *)pNodes[0]))
+        printf("The nodes are contiguous.\n");
+    else
+        printf("The nodes are scattered!\n");
+
+    dfree_batch(pNodes, got);
+    printf("Nodes freed with dfree_batch().\n");
+
+    printf("\n");
+    // *******************************************************************
+    // v3.0: Region Allocation (darena)
+    // *******************************************************************
+    printf("--- dalloc v3: Region Allocation Test ---\n");
+
+    darena_t *pRegion = darena_create(4096);
+
+    // Two requests: the second one starts right after the first, the cursor only moves forward
+    char *pFirst = darena_alloc(pRegion, 24);
+    char *pSecond = darena_alloc(pRegion, 24);
+    printf("pFirst: %p, pSecond: %p (Diff: %td byte)\n", pFirst, pSecond, pSecond - pFirst);
+
+    if (pSecond - pFirst == 32) printf("Bump allocation: no header between them.\n");
+    else printf("Unexpected gap between region allocations!\n");
+
+    // Reset: everything is released at once and the same memory is handed out again
+    darena_reset(pRegion);
+    char *pAgain = darena_alloc(pRegion, 24);
+    printf("After reset: %p\n", pAgain);
+
+    if (pAgain == pFirst) printf("Region reused after darena_reset().\n");
+    else printf("Region was not reused!\n");
+
+    darena_destroy(pRegion);
+
+    printf("\n");
+    // *******************************************************************
+    // v3.0: Statistics
+    // *******************************************************************
+    printf("--- dalloc v3: Statistics Test ---\n");
+
+    // Punch holes: free every other block, the free space is scattered
+    void *pHoles[8];
+    for (int i = 0; i < 8; ++i)
+        pHoles[i] = dalloc(1000);
+    for (int i = 0; i < 8; i += 2)
+        dfree(pHoles[i]);
+
+    dalloc_stats_t stats;
+    dalloc_stats(&stats);
+    printf("allocated: %zu bytes, free: %zu bytes in %zu blocks, fragmentation: %.1f%%\n",
+           stats.allocated_bytes, stats.free_bytes, stats.free_blocks, stats.fragmentation * 100.0);
+
+    if (stats.free_blocks >= 4 && stats.fragmentation > 0.0) printf("The holes are visible in the statistics.\n");
+    else printf("The holes are missing from the statistics!\n");
+
+    for (int i = 1; i < 8; i += 2)
+        dfree(pHoles[i]);
+
+    printf("\n");
+    // *******************************************************************
+    // v3.0: Decay in a forked child
+    // *******************************************************************
+    printf("--- dalloc v3: Decay After fork() ---\n");
+
+    // The purger thread is not copied by fork(): the child must start its own.
+    // A large block freed in the child has to be purged within a few decay periods.
+    dallopt(DALLOC_OPT_DECAY_MS, 50);
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        char *pLarge = dalloc(100 * 1024);
+        memset(pLarge, 1, 100 * 1024);
+
+        dalloc_stats(&stats);
+        unsigned long long before = stats.madvise_calls;
+
+        dfree(pLarge);
+        usleep(400 * 1000);
+
+        dalloc_stats(&stats);
+        _exit(stats.madvise_calls > before ? 0 : 1);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    dallopt(DALLOC_OPT_DECAY_MS, 0);
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) printf("The child purged its freed pages.\n");
+    else printf("The child never purged its freed pages!\n");
+
+    printf("\n");
+    // *******************************************************************
+    // v3.0: Heap profile of a forked child
+    // *******************************************************************
+    printf("--- dalloc v3: Heap Profile After fork() ---\n");
+
+    // The dumper thread is not copied either: the profile signal must still work in the child
+    dallopt(DALLOC_OPT_PROF_INTERVAL, 4096);
+    dallopt(DALLOC_OPT_PROF_SIGNAL, SIGUSR2);
+    fflush(stdout);
+
+    pid = fork();
+    if (pid == 0) {
+        for (int i = 0; i < 64; ++i)
+            dfree(dalloc(4096));
+
+        char path[64];
+        snprintf(path, sizeof(path), "dalloc.%d.0.heap", (int)getpid());
+        raise(SIGUSR2);
+
+        for (int i = 0; i < 100 && access(path, F_OK) != 0; ++i)
+            usleep(10 * 1000);
+
+        int written = access(path, F_OK) == 0;
+        unlink(path);
+        _exit(written ? 0 : 1);
+    }
+
+    waitpid(pid, &status, 0);
+    dallopt(DALLOC_OPT_PROF_INTERVAL, 0);
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) printf("The child wrote its heap profile.\n");
+    else printf("The child never wrote its heap profile!\n");
+
+    printf("\n");
+    // *******************************************************************
+    // v3.0: Zeroed Allocation
+    // *******************************************************************
+    printf("--- dalloc v3: Zeroed Allocation Test ---\n");
+
+    // [TEST 1] Dirty memory: three written neighbours merge into one free block when freed.
+    // Only that block fits two of them: dcalloc() gets it back and has to clear it, old headers included
+    printf("\n[TEST 1] dcalloc() on a reused block\n");
+    unsigned char *pDirty[3];
+    for (int i = 0; i < 3; ++i) {
+        pDirty[i] = dalloc(8000);
+        memset(pDirty[i], 0xAB, 8000);
+    }
+    void *pWall = dalloc(16); // Keeps the merged block apart from the free space after it
+    for (int i = 0; i < 3; ++i)
+        dfree(pDirty[i]);
+
+    unsigned char *pReused = dcalloc(2, 8000);
+    printf("pDirty[0]: %p, pReused: %p\n", (void *)pDirty[0], (void *)pReused);
+
+    all_zero = 1;
+    for (int i = 0; i < 2 * 8000; ++i)
+        if (pReused[i] != 0) all_zero = 0;
+
+    if (pReused == pDirty[0] && all_zero) printf("The merged block was reused and cleaned.\n");
+    else if (all_zero) printf("Another block was used (cleaned).\n");
+    else printf("Reused memory is not cleaned!\n");
+
+    dfree(pReused);
+    dfree(pWall);
+
+    // [TEST 2] Fresh memory: once the free space is taken, the heap grows with pages the kernel zeroed
+    printf("\n[TEST 2] dcalloc() on fresh pages\n");
+    dalloc_stats(&stats);
+    void *pFill = dalloc(stats.largest_free_block);
+    unsigned char *pFresh = dcalloc(1, 64 * 1024);
+
+    dalloc_stats_t grown;
+    dalloc_stats(&grown);
+    printf("mapped: %zu -> %zu bytes\n", stats.mapped_bytes, grown.mapped_bytes);
+
+    all_zero = 1;
+    for (int i = 0; i < 64 * 1024; ++i)
+        if (pFresh[i] != 0) all_zero = 0;
+
+    if (grown.mapped_bytes > stats.mapped_bytes && all_zero) printf("The heap grew, fresh memory is zero.\n");
+    else if (all_zero) printf("The heap did not grow (memory is zero).\n");
+    else printf("Fresh memory is not zero!\n");
+
+    dfree(pFresh);
+    dfree(pFill);
+
+    printf("\n");
+    // *******************************************************************
+    // v3.0: Trim
+    // *******************************************************************
+    printf("--- dalloc v3: Trim Test ---\n");
+
+    // A large span in the middle of the heap: written, then freed as one block.
+    // dalloc_trim() releases its whole pages (or the end of the heap) right away.
+    char *pSpan[4];
+    for (int i = 0; i < 4; ++i) {
+        pSpan[i] = dalloc(100 * 1024);
+        memset(pSpan[i], 1, 100 * 1024);
+    }
+    pWall = dalloc(16);
+    for (int i = 0; i < 4; ++i)
+        dfree(pSpan[i]);
+
+    dalloc_stats(&stats);
+    int released = dalloc_trim(0);
+    dalloc_stats(&grown);
+    printf("dalloc_trim(0): %d, madvise calls: %llu -> %llu, mapped: %zu -> %zu bytes\n", released,
+           stats.madvise_calls, grown.madvise_calls, stats.mapped_bytes, grown.mapped_bytes);
+
+    if (released && (grown.madvise_calls > stats.madvise_calls || grown.mapped_bytes < stats.mapped_bytes))
+        printf("The freed span was given back to the OS.\n");
+    else
+        printf("The freed span was kept!\n");
+
+    dfree(pWall);
+
+    printf("\n");
+    // *******************************************************************
+    // v3.0: Tail Growth
+    // *******************************************************************
+    printf("--- dalloc v3: Tail Growth Test ---\n");
+
+    // The largest free block is the end of the heap here: taking all of it leaves a block followed
+    // by the fence. Growing it commits more of its segment, the block is neither moved nor copied.
+    dalloc_stats(&stats);
+    size_t tail_size = stats.largest_free_block;
+    char *pTail = dalloc(tail_size);
+    memset(pTail, 'T', tail_size);
+
+    char *pGrown = drealloc(pTail, tail_size + 64 * 1024);
+    printf("pTail: %p (%zu byte), pGrown: %p (%zu byte)\n", (void *)pTail, tail_size,
+           (void *)pGrown, tail_size + 64 * 1024);
+
+    int kept = pGrown != NULL;
+    for (size_t i = 0; kept && i < tail_size; ++i)
+        if (pGrown[i] != 'T') kept = 0;
+
+    if (pGrown == pTail && kept) printf("Grown in place at the end of the heap, contents kept.\n");
+    else if (kept) printf("Moved to grow (contents kept).\n");
+    else printf("The contents were lost!\n");
+
+    dfree(pGrown);
+
+    printf("\n");
+    // *******************************************************************
+    // v3.0: Trace Round Trip
+    // *******************************************************************
+    printf("--- dalloc v3: Trace Round Trip Test ---\n");
+
+    // Record a known sequence: 4 allocations, a drealloc (2 records), a dcalloc and 5 frees
+    const char *pTracePath = "dalloc_main.trace";
+    if (dalloc_trace_start(pTracePath) != 0)
+        perror("dalloc_trace_start");
+
+    void *pTraced[4];
+    for (int i = 0; i < 4; ++i)
+        pTraced[i] = dalloc(100 * (i + 1));
+    pTraced[0] = drealloc(pTraced[0], 1000);
+    void *pTracedZero = dcalloc(10, 10);
+    for (int i = 0; i < 4; ++i)
+        dfree(pTraced[i]);
+    dfree(pTracedZero);
+
+    dalloc_trace_stop();
+
+    // Replay it: the same calls again, objects are matched by the address recorded for them
+    struct { uint64_t id; void *ptr; size_t size; } objects[8];
+    int object_count = 0, pending = -1;
+    size_t records = 0, live = 0;
+
+    FILE *pTrace = fopen(pTracePath, "rb");
+    dalloc_trace_header_t header;
+    dalloc_trace_record_t record;
+
+    if (pTrace && fread(&header, sizeof(header), 1, pTrace) == 1 && !memcmp(header.magic, DALLOC_TRACE_MAGIC, 8))
+        while (fread(&record, sizeof(record), 1, pTrace) == 1) {
+            int found = -1;
+            for (int i = 0; i < object_count; ++i)
+                if (objects[i].id == record.id) found = i;
+
+            ++records;
+            switch (record.op) {
+            case DALLOC_TRACE_ALLOC:
+            case DALLOC_TRACE_CALLOC:
+                if (object_count == 8) break;
+                objects[object_count].id = record.id;
+                objects[object_count].ptr = record.op == DALLOC_TRACE_ALLOC ? dalloc(record.size) : dcalloc(1, record.size);
+                objects[object_count++].size = record.size;
+                live += record.size;
+                break;
+            case DALLOC_TRACE_REALLOC:
+                pending = found;
+                break;
+            case DALLOC_TRACE_REALLOC_END:
+                if (pending < 0) break;
+                objects[pending].ptr = drealloc(objects[pending].ptr, record.size);
+                live += record.size - objects[pending].size;
+                objects[pending].id = record.id;
+                objects[pending].size = record.size;
+                break;
+            case DALLOC_TRACE_FREE:
+                if (found < 0) break;
+                dfree(objects[found].ptr);
+                live -= objects[found].size;
+                objects[found] = objects[--object_count];
+                break;
+            }
+        }
+
+    if (pTrace) fclose(pTrace);
+    unlink(pTracePath);
+
+    printf("records: %zu, live at the end of the replay: %zu bytes\n", records, live);
+
+    if (records == 12 && live == 0) printf("The trace was recorded and replayed completely.\n");
+    else printf("The trace does not match the calls made!\n");
+
+    dalloc_stats_print();
+
     return 0;
 }
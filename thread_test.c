@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>	// for usleep
 #include "dalloc.h"
 
@@ -30,10 +31,10 @@ void *worker_routine(void *arg)
 		// To increase 'race condition'
 		usleep(10);
 
-		// Recursive Mutex Test (Dreallock)
+		// Relocation Test (drealloc)
 		// Make the block very large so that it becomes a "Relocation". 
-		// dalloc is called internally during relocation. 
-		// If the Recursive Mutex is not working, a deadlock will occur here, and the program will freeze.
+		// dalloc and dfree are called internally during relocation, maybe on another thread's arena.
+		// If the arena locks were held across them, a deadlock would occur here, and the program would freeze.
 		int *pNewData = (int *)drealloc(pData, 2048);
 
 		if (pNewData == NULL) {
@@ -58,6 +59,91 @@ void *worker_routine(void *arg)
 	return NULL;
 }
 
+// Remote free test: blocks of one thread freed by another
+#define REMOTE_BLOCKS 256
+#define REMOTE_SIZE 1024	// Above the thread cache and slab sizes: the blocks go back to the owner's arena
+#define REMOTE_ROUNDS 100
+
+static void *pRemoteBlocks[REMOTE_BLOCKS];
+static pthread_barrier_t remote_barrier;
+static int remote_freeing;	// Set while the freeing thread works through pRemoteBlocks
+static int remote_churning;	// Set once the owner keeps its arena busy
+static int remote_done;		// Set by the owner once a free went through the remote queue
+static int remote_reused;	// Blocks the owner got back after the queue was drained
+
+// Thread A: allocates the blocks, and keeps its arena's lock busy while they are freed
+// (batches are made under the lock), so that some frees cannot take it and are queued instead
+void *owner_routine(void *arg)
+{
+	(void)arg;
+
+	void *pChurn[1024];
+
+	dalloc_stats_t stats;
+	dalloc_stats(&stats);
+	unsigned long long before = stats.remote_frees;
+
+	for (int round = 0; round < REMOTE_ROUNDS && !remote_done; ++round) {
+		for (int i = 0; i < REMOTE_BLOCKS; ++i)
+			pRemoteBlocks[i] = dalloc(REMOTE_SIZE);
+
+		__atomic_store_n(&remote_freeing, 1, __ATOMIC_RELEASE);
+		pthread_barrier_wait(&remote_barrier);
+
+		while (__atomic_load_n(&remote_freeing, __ATOMIC_ACQUIRE)) {
+			size_t got = dalloc_batch(REMOTE_SIZE, 1024, pChurn);
+			__atomic_store_n(&remote_churning, 1, __ATOMIC_RELEASE);
+			dfree_batch(pChurn, got);
+		}
+		__atomic_store_n(&remote_churning, 0, __ATOMIC_RELAXED);
+
+		dalloc_stats(&stats);
+		if (stats.remote_frees > before || round == REMOTE_ROUNDS - 1)
+			remote_done = 1;
+
+		pthread_barrier_wait(&remote_barrier);
+	}
+
+	// Taking the lock drains the queue: the freed blocks are handed out again
+	void *pAgain[REMOTE_BLOCKS];
+	for (int i = 0; i < REMOTE_BLOCKS; ++i) {
+		pAgain[i] = dalloc(REMOTE_SIZE);
+		for (int j = 0; j < REMOTE_BLOCKS; ++j)
+			if (pAgain[i] == pRemoteBlocks[j]) {
+				++remote_reused;
+				break;
+			}
+	}
+
+	for (int i = 0; i < REMOTE_BLOCKS; ++i)
+		dfree(pAgain[i]);
+
+	return NULL;
+}
+
+// Thread B: frees what A allocated
+void *freer_routine(void *arg)
+{
+	(void)arg;
+
+	int done = 0;
+	while (!done) {
+		pthread_barrier_wait(&remote_barrier);
+
+		while (!__atomic_load_n(&remote_churning, __ATOMIC_ACQUIRE))
+			sched_yield();
+
+		for (int i = 0; i < REMOTE_BLOCKS; ++i)
+			dfree(pRemoteBlocks[i]);
+
+		__atomic_store_n(&remote_freeing, 0, __ATOMIC_RELEASE);
+		pthread_barrier_wait(&remote_barrier);
+		done = remote_done;
+	}
+
+	return NULL;
+}
+
 int main()
 {
 	printf("*** dalloc Multi-Thread Stress Test ***\n");
@@ -81,5 +167,27 @@ int main()
 	printf("If there was a Deadlock, the program would freeze.\n");
 	printf("If there was a Race Condition, we would get a 'Segmentation Fault' or the data would be corrupted.\n");
 
+	printf("\n*** dalloc Remote Free Test ***\n");
+
+	pthread_t owner, freer;
+	pthread_barrier_init(&remote_barrier, NULL, 2);
+	pthread_create(&owner, NULL, owner_routine, NULL);
+	pthread_create(&freer, NULL, freer_routine, NULL);
+	pthread_join(owner, NULL);
+	pthread_join(freer, NULL);
+	pthread_barrier_destroy(&remote_barrier);
+
+	dalloc_stats_t stats;
+	dalloc_stats(&stats);
+	printf("Remote frees: %llu, blocks reused by the owner: %d of %d, allocated at the end: %zu bytes\n",
+		stats.remote_frees, remote_reused, REMOTE_BLOCKS, stats.allocated_bytes);
+
+	if (stats.remote_frees == 0 || remote_reused == 0 || stats.allocated_bytes != 0) {
+		fprintf(stderr, "Error: Blocks freed by another thread were not given back!\n");
+		return 1;
+	}
+
+	printf("Blocks freed by another thread went back to their arena and were reused.\n");
+
 	return 0;
 }